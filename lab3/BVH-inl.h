@@ -0,0 +1,338 @@
+#pragma once
+
+#include "SystemDS.h"
+#include "ThreadPool-inl.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+
+namespace ICG {
+
+struct Triangle {
+  vec3 a, b, c;
+};
+
+// closest point to p on triangle t, from Ericson's Real-Time Collision
+// Detection 5.1.5
+inline vec3 closestOnTriangle(const vec3 &p, const Triangle &t) {
+  auto sub = [](const vec3 &u, const vec3 &v) {
+    return vec3{u[0] - v[0], u[1] - v[1], u[2] - v[2]};
+  };
+  auto dot = [](const vec3 &u, const vec3 &v) {
+    return u[0] * v[0] + u[1] * v[1] + u[2] * v[2];
+  };
+  auto at = [&](double s, double r) {
+    vec3 q;
+    for (int k = 0; k < 3; ++k) {
+      q[k] = t.a[k] + s * (t.b[k] - t.a[k]) + r * (t.c[k] - t.a[k]);
+    }
+    return q;
+  };
+  vec3 ab = sub(t.b, t.a), ac = sub(t.c, t.a), ap = sub(p, t.a);
+  double d1 = dot(ab, ap), d2 = dot(ac, ap);
+  if (d1 <= 0 && d2 <= 0) {
+    return t.a;
+  }
+  vec3 bp = sub(p, t.b);
+  double d3 = dot(ab, bp), d4 = dot(ac, bp);
+  if (d3 >= 0 && d4 <= d3) {
+    return t.b;
+  }
+  double vc = d1 * d4 - d3 * d2;
+  if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+    return at(d1 / (d1 - d3), 0);
+  }
+  vec3 cp = sub(p, t.c);
+  double d5 = dot(ab, cp), d6 = dot(ac, cp);
+  if (d6 >= 0 && d5 <= d6) {
+    return t.c;
+  }
+  double vb = d5 * d2 - d1 * d6;
+  if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+    return at(0, d2 / (d2 - d6));
+  }
+  double va = d3 * d6 - d5 * d4;
+  if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+    double w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+    return at(1 - w, w);
+  }
+  double denom = 1 / (va + vb + vc);
+  return at(vb * denom, vc * denom);
+}
+
+// Bounding volume hierarchy over static triangles, split with the surface
+// area heuristic evaluated on kBins centroid bins. The top of the tree is
+// split serially until there are enough independent ranges, then the
+// subtrees are built in parallel and stitched together. Children of a node
+// are stored next to each other.
+class BVH {
+public:
+  struct Node {
+    vec3 lo, hi;
+    // first child for an inner node, first triangle for a leaf
+    int first;
+    // triangles in a leaf, 0 for an inner node
+    int count;
+  };
+
+  vector<Triangle> triangles;
+  vector<Node> nodes;
+
+  void build(vector<Triangle> &&input, ThreadPool &threads) {
+    triangles = move(input);
+    int n = triangles.size();
+    nodes.clear();
+    if (n == 0) {
+      return;
+    }
+    bounds.resize(n);
+    order.resize(n);
+    threads.parallelFor(n, 4096, [&](int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        const auto &t = triangles[i];
+        for (int k = 0; k < 3; ++k) {
+          bounds[i].lo[k] = min({t.a[k], t.b[k], t.c[k]});
+          bounds[i].hi[k] = max({t.a[k], t.b[k], t.c[k]});
+          bounds[i].centroid[k] = (bounds[i].lo[k] + bounds[i].hi[k]) / 2;
+        }
+        order[i] = i;
+      }
+    });
+
+    // split the top serially until every thread has a few subtrees to build
+    struct Task {
+      int node, begin, end, depth;
+    };
+    vector<Task> open{{0, 0, n, 0}}, tasks;
+    nodes.emplace_back();
+    size_t target = threads.size() * 4;
+    while (!open.empty()) {
+      auto largest = max_element(
+          open.begin(), open.end(), [](const Task &a, const Task &b) {
+            return a.end - a.begin < b.end - b.begin;
+          });
+      Task task = *largest;
+      open.erase(largest);
+      int mid;
+      if (open.size() + tasks.size() + 1 >= target ||
+          task.end - task.begin < kParallelMin ||
+          !split(task.begin, task.end, task.depth, nodes[task.node], mid)) {
+        tasks.emplace_back(task);
+        continue;
+      }
+      int child = nodes.size();
+      nodes[task.node].first = child;
+      nodes[task.node].count = 0;
+      nodes.resize(child + 2);
+      open.push_back({child, task.begin, mid, task.depth + 1});
+      open.push_back({child + 1, mid, task.end, task.depth + 1});
+    }
+
+    vector<vector<Node>> subtrees(tasks.size());
+    threads.parallelFor(tasks.size(), 1, [&](int begin, int end) {
+      for (int t = begin; t < end; ++t) {
+        subtrees[t].emplace_back();
+        buildRange(subtrees[t], 0, tasks[t].begin, tasks[t].end,
+                   tasks[t].depth);
+      }
+    });
+    // the subtree root replaces its placeholder, the rest is appended
+    for (size_t t = 0; t < tasks.size(); ++t) {
+      int offset = nodes.size() - 1;
+      for (auto &node : subtrees[t]) {
+        if (node.count == 0) {
+          node.first += offset;
+        }
+      }
+      nodes[tasks[t].node] = subtrees[t][0];
+      nodes.insert(nodes.end(), subtrees[t].begin() + 1, subtrees[t].end());
+    }
+
+    // leaves address triangles directly
+    vector<Triangle> sorted(n);
+    for (int i = 0; i < n; ++i) {
+      sorted[i] = triangles[order[i]];
+    }
+    triangles.swap(sorted);
+    bounds.clear();
+    order.clear();
+  }
+
+  // closest point of the mesh to p that is nearer than maxDist, the search
+  // skips every node farther away than the best point found so far
+  bool closestPoint(const vec3 &p, double maxDist, vec3 &point) const {
+    if (nodes.empty()) {
+      return false;
+    }
+    double best = maxDist * maxDist;
+    bool found = false;
+    int stack[kMaxDepth + 1], top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+      const Node &node = nodes[stack[--top]];
+      if (boxDistance(node, p) >= best) {
+        continue;
+      }
+      if (node.count > 0) {
+        for (int i = node.first; i < node.first + node.count; ++i) {
+          vec3 q = closestOnTriangle(p, triangles[i]);
+          double d = 0;
+          for (int k = 0; k < 3; ++k) {
+            d += (q[k] - p[k]) * (q[k] - p[k]);
+          }
+          if (d < best) {
+            best = d;
+            point = q;
+            found = true;
+          }
+        }
+        continue;
+      }
+      // visit the nearer child first so it tightens best early
+      int near = node.first, far = node.first + 1;
+      if (boxDistance(nodes[near], p) > boxDistance(nodes[far], p)) {
+        swap(near, far);
+      }
+      stack[top++] = far;
+      stack[top++] = near;
+    }
+    return found;
+  }
+
+private:
+  static const int kBins = 16;
+  static const int kLeafSize = 4;
+  static const int kParallelMin = 1024;
+  // deeper ranges become leaves, which bounds the traversal stack
+  static const int kMaxDepth = 64;
+
+  struct Bounds {
+    vec3 lo, hi, centroid;
+  };
+  vector<Bounds> bounds;
+  vector<int> order;
+
+  static double area(const vec3 &lo, const vec3 &hi) {
+    double dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+    return dx < 0 ? 0 : 2 * (dx * dy + dy * dz + dz * dx);
+  }
+
+  static double boxDistance(const Node &node, const vec3 &p) {
+    double d = 0;
+    for (int k = 0; k < 3; ++k) {
+      double e = max({node.lo[k] - p[k], 0.0, p[k] - node.hi[k]});
+      d += e * e;
+    }
+    return d;
+  }
+
+  static void grow(vec3 &lo, vec3 &hi, const Bounds &b) {
+    for (int k = 0; k < 3; ++k) {
+      lo[k] = min(lo[k], b.lo[k]);
+      hi[k] = max(hi[k], b.hi[k]);
+    }
+  }
+
+  // fit node to [begin, end) and partition the range at mid, false when
+  // the range is better kept as a leaf
+  bool split(int begin, int end, int depth, Node &node, int &mid) {
+    vec3 clo, chi;
+    node.lo = clo = {HUGE_VAL, HUGE_VAL, HUGE_VAL};
+    node.hi = chi = {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+    for (int i = begin; i < end; ++i) {
+      const auto &b = bounds[order[i]];
+      grow(node.lo, node.hi, b);
+      for (int k = 0; k < 3; ++k) {
+        clo[k] = min(clo[k], b.centroid[k]);
+        chi[k] = max(chi[k], b.centroid[k]);
+      }
+    }
+    node.first = begin;
+    node.count = end - begin;
+    if (end - begin <= kLeafSize || depth >= kMaxDepth) {
+      return false;
+    }
+    int axis = 0;
+    for (int k = 1; k < 3; ++k) {
+      if (chi[k] - clo[k] > chi[axis] - clo[axis]) {
+        axis = k;
+      }
+    }
+    double extent = chi[axis] - clo[axis];
+    if (extent <= 0) {
+      return false;
+    }
+
+    struct Bin {
+      vec3 lo{{HUGE_VAL, HUGE_VAL, HUGE_VAL}};
+      vec3 hi{{-HUGE_VAL, -HUGE_VAL, -HUGE_VAL}};
+      int count{0};
+    } bins[kBins];
+    auto binOf = [&](int i) {
+      int b = (bounds[i].centroid[axis] - clo[axis]) / extent * kBins;
+      return min(b, kBins - 1);
+    };
+    for (int i = begin; i < end; ++i) {
+      auto &bin = bins[binOf(order[i])];
+      grow(bin.lo, bin.hi, bounds[order[i]]);
+      bin.count++;
+    }
+    // sweep from the right, then from the left, for the cost of every plane
+    double rightCost[kBins];
+    Bin acc;
+    for (int b = kBins - 1; b > 0; --b) {
+      grow(acc.lo, acc.hi, {bins[b].lo, bins[b].hi, {}});
+      acc.count += bins[b].count;
+      rightCost[b] = acc.count * area(acc.lo, acc.hi);
+    }
+    acc = Bin();
+    double bestCost = HUGE_VAL;
+    int bestPlane = -1;
+    for (int b = 0; b + 1 < kBins; ++b) {
+      grow(acc.lo, acc.hi, {bins[b].lo, bins[b].hi, {}});
+      acc.count += bins[b].count;
+      double cost = acc.count * area(acc.lo, acc.hi) + rightCost[b + 1];
+      if (acc.count > 0 && acc.count < end - begin && cost < bestCost) {
+        bestCost = cost;
+        bestPlane = b;
+      }
+    }
+    // a leaf costs one test per triangle
+    if (bestPlane < 0 ||
+        (bestCost >= (end - begin) * area(node.lo, node.hi) &&
+         end - begin <= kLeafSize * 4)) {
+      return false;
+    }
+    mid = partition(order.begin() + begin, order.begin() + end,
+                    [&](int i) { return binOf(i) <= bestPlane; }) -
+          order.begin();
+    return true;
+  }
+
+  void buildRange(vector<Node> &out, int node, int begin, int end,
+                  int depth) {
+    int mid;
+    if (!split(begin, end, depth, out[node], mid)) {
+      return;
+    }
+    int child = out.size();
+    out[node].first = child;
+    out[node].count = 0;
+    out.resize(child + 2);
+    buildRange(out, child, begin, mid, depth + 1);
+    buildRange(out, child + 1, mid, end, depth + 1);
+  }
+};
+
+// static collision geometry loaded from an OBJ file
+struct CollisionMesh {
+  BVH bvh;
+  // draws the mesh, the triangles already include its position
+  shared_ptr<Object> model;
+};
+
+} // namespace ICG
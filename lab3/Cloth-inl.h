@@ -0,0 +1,361 @@
+#pragma once
+
+#include "SystemDS.h"
+#include "ThreadPool-inl.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ICG_CLOTH_AVX2 1
+#endif
+
+using namespace std;
+
+namespace ICG {
+
+// Position-based dynamics cloth (Mueller et al. 2007). A sheet of nx * ny
+// particles is held together by distance constraints: structural and shear
+// edges keep the shape, edges that skip one particle resist bending. The
+// constraints are greedily colored so no two of one color share a particle,
+// then every color is solved in parallel and in blocks of kLanes. A block
+// gathers its particles, computes the corrections of all lanes at once and
+// scatters them back. The AVX2 kernel is picked at runtime and the scalar
+// one does the same arithmetic, so both give the same sheet. One iteration
+// costs O(constraints).
+class Cloth {
+public:
+  int nx, ny;
+  double spacing;
+  // the step is split into substeps, each solving every constraint
+  // iterations times
+  int substeps{1};
+  int iterations{10};
+  // fraction of the violation removed per solve, 1 is rigid
+  double stiffness{1};
+  double bendStiffness{0.1};
+  // velocity lost per step and total mass of the sheet
+  double damping{0.01};
+  double mass{1};
+
+  int count{0};
+  vector<float> x, y, z;
+  // previous positions, velocity is (x - px) / deltaT
+  vector<float> px, py, pz;
+  vector<float> invMass;
+
+  // constraints of color c are [colorStart[c], colorStart[c + 1])
+  vector<int> ca, cb;
+  vector<float> rest, weight;
+  vector<int> colorStart;
+
+  // interleaved positions and structural edges handed to glDrawElements
+  vector<float> vertices;
+  vector<GLuint> lines;
+
+  Cloth() {
+#ifdef ICG_CLOTH_AVX2
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+  }
+
+  // lay the sheet in the xz plane from origin, pinned corners do not move
+  void build(const vec3 &origin, bool pinCorners) {
+    count = nx * ny;
+    for (int i = 0; i < nx; ++i) {
+      for (int j = 0; j < ny; ++j) {
+        x.emplace_back(origin[0] + i * spacing);
+        y.emplace_back(origin[1]);
+        z.emplace_back(origin[2] + j * spacing);
+      }
+    }
+    px = x, py = y, pz = z;
+    invMass.assign(count, count / mass);
+    if (pinCorners) {
+      invMass[id(0, 0)] = invMass[id(nx - 1, 0)] = 0;
+      invMass[id(0, ny - 1)] = invMass[id(nx - 1, ny - 1)] = 0;
+    }
+
+    vector<int> a, b;
+    vector<float> k;
+    auto link = [&](int i0, int j0, int i1, int j1, float stiff) {
+      if (i1 < nx && j1 >= 0 && j1 < ny) {
+        a.emplace_back(id(i0, j0));
+        b.emplace_back(id(i1, j1));
+        k.emplace_back(stiff);
+      }
+    };
+    for (int i = 0; i < nx; ++i) {
+      for (int j = 0; j < ny; ++j) {
+        link(i, j, i + 1, j, stiffness);
+        link(i, j, i, j + 1, stiffness);
+        link(i, j, i + 1, j + 1, stiffness);
+        link(i, j, i + 1, j - 1, stiffness);
+        link(i, j, i + 2, j, bendStiffness);
+        link(i, j, i, j + 2, bendStiffness);
+      }
+    }
+    for (size_t c = 0; c < a.size(); ++c) {
+      int di = b[c] / ny - a[c] / ny, dj = b[c] % ny - a[c] % ny;
+      if (di + abs(dj) == 1) {
+        lines.insert(lines.end(), {(GLuint)a[c], (GLuint)b[c]});
+      }
+    }
+    color(a, b, k);
+    vertices.assign(count * 3, 0);
+    fillVertices();
+  }
+
+  void update(double deltaT, FrameSystem &fs, ThreadPool &threads) {
+    for (int s = 0; s < substeps; ++s) {
+      substep(deltaT / substeps, fs, threads);
+    }
+    fillVertices();
+  }
+
+  void fillVertices() {
+    for (int i = 0; i < count; ++i) {
+      vertices[i * 3] = x[i];
+      vertices[i * 3 + 1] = y[i];
+      vertices[i * 3 + 2] = z[i];
+    }
+  }
+
+private:
+  bool avx2{false};
+  // balls near the cloth in the last collideBalls
+  vector<int> near;
+  static const int kChunk = 1024;
+  static const int kLanes = 8;
+
+  int id(int i, int j) const { return i * ny + j; }
+
+  void substep(double deltaT, FrameSystem &fs, ThreadPool &threads) {
+    float dt = deltaT, g = Object::g;
+    float keep = pow(1 - damping, 1.0 / substeps);
+    threads.parallelFor(count, kChunk, [&](int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        float vx = (x[i] - px[i]) * keep, vy = (y[i] - py[i]) * keep,
+              vz = (z[i] - pz[i]) * keep;
+        vy -= invMass[i] > 0 ? g * dt * dt : 0;
+        px[i] = x[i], py[i] = y[i], pz[i] = z[i];
+        x[i] += vx, y[i] += vy, z[i] += vz;
+      }
+    });
+    for (int it = 0; it < iterations; ++it) {
+      for (size_t c = 0; c + 1 < colorStart.size(); ++c) {
+        int first = colorStart[c], n = colorStart[c + 1] - first;
+        threads.parallelFor(n, kChunk, [&](int begin, int end) {
+          solve(first + begin, first + end);
+        });
+      }
+    }
+    collideBalls(deltaT, fs);
+    threads.parallelFor(count, kChunk, [&](int begin, int end) {
+      boxCheck(begin, end, fs.boxSize);
+    });
+  }
+
+  // greedy coloring, a constraint takes the first color none of the
+  // constraints sharing one of its particles has taken
+  void color(const vector<int> &a, const vector<int> &b,
+             const vector<float> &k) {
+    int n = a.size();
+    // bit c of used[p] is set when particle p is in a constraint of color c
+    vector<uint64_t> used(count, 0);
+    vector<int> colorOf(n);
+    int colors = 0;
+    for (int c = 0; c < n; ++c) {
+      uint64_t taken = used[a[c]] | used[b[c]];
+      int pick = 0;
+      while (pick < 63 && (taken >> pick & 1)) {
+        pick++;
+      }
+      colorOf[c] = pick;
+      used[a[c]] |= 1ull << pick;
+      used[b[c]] |= 1ull << pick;
+      colors = max(colors, pick + 1);
+    }
+    colorStart.assign(colors + 1, 0);
+    for (int c = 0; c < n; ++c) {
+      colorStart[colorOf[c] + 1]++;
+    }
+    for (int c = 0; c < colors; ++c) {
+      colorStart[c + 1] += colorStart[c];
+    }
+    vector<int> slot(colorStart.begin(), colorStart.end() - 1);
+    ca.resize(n), cb.resize(n), rest.resize(n), weight.resize(n);
+    for (int c = 0; c < n; ++c) {
+      int to = slot[colorOf[c]]++;
+      ca[to] = a[c], cb[to] = b[c];
+      float dx = x[b[c]] - x[a[c]], dy = y[b[c]] - y[a[c]],
+            dz = z[b[c]] - z[a[c]];
+      rest[to] = sqrt(dx * dx + dy * dy + dz * dz);
+      // stiffness per iteration so the sheet is as stiff whatever the budget
+      weight[to] = 1 - pow(1 - k[c], 1.0 / (iterations * substeps));
+    }
+  }
+
+  // constraints in [begin, end) share no particle, so lanes never alias
+  void solve(int begin, int end) {
+    int base = begin;
+#ifdef ICG_CLOTH_AVX2
+    if (avx2) {
+      for (; base + kLanes <= end; base += kLanes) {
+        solveAVX2(base);
+      }
+    }
+#endif
+    for (; base < end; base += kLanes) {
+      solveScalar(base, min(end - base, (int)kLanes));
+    }
+  }
+
+  void solveScalar(int base, int n) {
+    float dx[kLanes], dy[kLanes], dz[kLanes], wa[kLanes], wb[kLanes],
+        s[kLanes];
+    for (int l = 0; l < n; ++l) {
+      int a = ca[base + l], b = cb[base + l];
+      dx[l] = x[b] - x[a], dy[l] = y[b] - y[a], dz[l] = z[b] - z[a];
+      wa[l] = invMass[a], wb[l] = invMass[b];
+      float d = sqrt(dx[l] * dx[l] + dy[l] * dy[l] + dz[l] * dz[l]);
+      s[l] = weight[base + l] * (d - rest[base + l]) /
+             ((wa[l] + wb[l] + 1e-12f) * (d + 1e-12f));
+    }
+    scatter(base, n, dx, dy, dz, wa, wb, s);
+  }
+
+  void scatter(int base, int n, const float *dx, const float *dy,
+               const float *dz, const float *wa, const float *wb,
+               const float *s) {
+    for (int l = 0; l < n; ++l) {
+      int a = ca[base + l], b = cb[base + l];
+      x[a] += wa[l] * s[l] * dx[l], y[a] += wa[l] * s[l] * dy[l],
+          z[a] += wa[l] * s[l] * dz[l];
+      x[b] -= wb[l] * s[l] * dx[l], y[b] -= wb[l] * s[l] * dy[l],
+          z[b] -= wb[l] * s[l] * dz[l];
+    }
+  }
+
+#ifdef ICG_CLOTH_AVX2
+  // kLanes constraints from base, AVX2 has no scatter so that stays scalar
+  __attribute__((target("avx2"))) void solveAVX2(int base) {
+    __m256i ia = _mm256_loadu_si256((const __m256i *)&ca[base]);
+    __m256i ib = _mm256_loadu_si256((const __m256i *)&cb[base]);
+    __m256 dx = _mm256_sub_ps(_mm256_i32gather_ps(x.data(), ib, 4),
+                              _mm256_i32gather_ps(x.data(), ia, 4));
+    __m256 dy = _mm256_sub_ps(_mm256_i32gather_ps(y.data(), ib, 4),
+                              _mm256_i32gather_ps(y.data(), ia, 4));
+    __m256 dz = _mm256_sub_ps(_mm256_i32gather_ps(z.data(), ib, 4),
+                              _mm256_i32gather_ps(z.data(), ia, 4));
+    __m256 wa = _mm256_i32gather_ps(invMass.data(), ia, 4);
+    __m256 wb = _mm256_i32gather_ps(invMass.data(), ib, 4);
+    __m256 eps = _mm256_set1_ps(1e-12f);
+    __m256 d = _mm256_sqrt_ps(
+        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx),
+                                    _mm256_mul_ps(dy, dy)),
+                      _mm256_mul_ps(dz, dz)));
+    __m256 s = _mm256_div_ps(
+        _mm256_mul_ps(_mm256_loadu_ps(&weight[base]),
+                      _mm256_sub_ps(d, _mm256_loadu_ps(&rest[base]))),
+        _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(wa, wb), eps),
+                      _mm256_add_ps(d, eps)));
+    alignas(32) float lanes[6][kLanes];
+    _mm256_store_ps(lanes[0], dx);
+    _mm256_store_ps(lanes[1], dy);
+    _mm256_store_ps(lanes[2], dz);
+    _mm256_store_ps(lanes[3], wa);
+    _mm256_store_ps(lanes[4], wb);
+    _mm256_store_ps(lanes[5], s);
+    scatter(base, kLanes, lanes[0], lanes[1], lanes[2], lanes[3], lanes[4],
+            lanes[5]);
+  }
+#endif
+
+  // push particles out of the balls, the ball takes the momentum the
+  // particles lose. Only the balls the broadphase finds around the box of
+  // the cloth are tried, in index order.
+  void collideBalls(double deltaT, FrameSystem &fs) {
+    if (count == 0 || fs.objects.empty()) {
+      return;
+    }
+    float m = mass / count, thickness = spacing * 0.25;
+    fs.indexBroadphase();
+    double reach = fs.broadphase.cellSize / 2 + thickness;
+    vec3 lo{HUGE_VAL, HUGE_VAL, HUGE_VAL}, hi{-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+    const float *axis[3] = {x.data(), y.data(), z.data()};
+    for (int k = 0; k < 3; ++k) {
+      for (int i = 0; i < count; ++i) {
+        lo[k] = min(lo[k], (double)axis[k][i]);
+        hi[k] = max(hi[k], (double)axis[k][i]);
+      }
+      lo[k] -= reach;
+      hi[k] += reach;
+    }
+    near.clear();
+    fs.broadphase.query(lo, hi, [&](int id) { near.emplace_back(id); });
+    sort(near.begin(), near.end());
+    for (int id : near) {
+      const auto &object = fs.objects[id];
+      float r = object->radius + thickness;
+      vec3 impulse{0, 0, 0};
+      for (int i = 0; i < count; ++i) {
+        float d[3] = {x[i] - (float)object->pos[0],
+                      y[i] - (float)object->pos[1],
+                      z[i] - (float)object->pos[2]};
+        if (abs(d[0]) >= r || abs(d[1]) >= r || abs(d[2]) >= r ||
+            invMass[i] == 0) {
+          continue;
+        }
+        float len = sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+        if (len >= r || len < 1e-6f) {
+          continue;
+        }
+        float *p[3] = {&x[i], &y[i], &z[i]};
+        float *prev[3] = {&px[i], &py[i], &pz[i]};
+        float v[3], vn = 0;
+        for (int k = 0; k < 3; ++k) {
+          d[k] /= len;
+          v[k] = (*p[k] - *prev[k]) / deltaT;
+          vn += (v[k] - object->v[k]) * d[k];
+        }
+        // on the surface and no longer moving into the ball
+        vn = min(vn, 0.0f);
+        for (int k = 0; k < 3; ++k) {
+          *p[k] = object->pos[k] + d[k] * r;
+          *prev[k] = *p[k] - (v[k] - vn * d[k]) * deltaT;
+          impulse[k] += m * vn * d[k];
+        }
+      }
+      if (impulse[0] || impulse[1] || impulse[2]) {
+        if (object->sleeping) {
+          fs.wake(id);
+        }
+        for (int k = 0; k < 3; ++k) {
+          object->v[k] += impulse[k] / object->mass;
+        }
+      }
+    }
+  }
+
+  // same walls as Object::boxCheck, a particle on a wall stops
+  void boxCheck(int begin, int end, double boxSize) {
+    float *p[3] = {x.data(), y.data(), z.data()};
+    float *prev[3] = {px.data(), py.data(), pz.data()};
+    for (int k = 0; k < 3; ++k) {
+      float offset = k == 2 ? -3 * boxSize : 0;
+      float lo = offset - boxSize, hi = offset + boxSize;
+      for (int i = begin; i < end; ++i) {
+        if (p[k][i] < lo || p[k][i] > hi) {
+          p[k][i] = min(max(p[k][i], lo), hi);
+          prev[k][i] = p[k][i];
+        }
+      }
+    }
+  }
+};
+
+} // namespace ICG
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "SystemDS.h"
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+namespace ICG {
+
+// Live particles of one emitter, kept as structure of arrays in storage that
+// is allocated once. Spawning appends, killing moves the last particle into
+// the hole, so both are O(1) and the live range always stays dense.
+class ParticlePool {
+public:
+  int capacity{0};
+  int count{0};
+  vector<float> x, y, z;
+  vector<float> vx, vy, vz;
+  vector<float> age, life;
+  // interleaved positions handed to glDrawArrays
+  vector<float> vertices;
+
+  void reserve(int n) {
+    capacity = n;
+    for (auto array : {&x, &y, &z, &vx, &vy, &vz, &age, &life}) {
+      array->assign(n, 0);
+    }
+    vertices.assign(n * 3, 0);
+  }
+
+  int spawn() { return count < capacity ? count++ : -1; }
+
+  void fillVertices() {
+    for (auto axis : {0, 1, 2}) {
+      const float *p = (axis == 0 ? x : axis == 1 ? y : z).data();
+      for (int i = 0; i < count; ++i) {
+        vertices[i * 3 + axis] = p[i];
+      }
+    }
+  }
+
+  void kill(int i) {
+    count--;
+    for (auto array : {&x, &y, &z, &vx, &vy, &vz, &age, &life}) {
+      (*array)[i] = (*array)[count];
+    }
+  }
+};
+
+class Emitter {
+public:
+  // particles per second and seconds each of them lives
+  double rate;
+  double lifetime;
+  // point size in pixels
+  double size;
+  double cofRes{0.5};
+  vec3 pos;
+  vec3 v;
+  // standard deviation of the initial velocity around v
+  double spread;
+
+  // fraction of a particle carried over to the next frame
+  double pending{0};
+  mt19937 rng;
+  ParticlePool pool;
+
+  void update(double deltaT, double boxSize) {
+    int n = pool.count;
+    float dt = deltaT, g = Object::g;
+    float *px[3] = {pool.x.data(), pool.y.data(), pool.z.data()};
+    float *pv[3] = {pool.vx.data(), pool.vy.data(), pool.vz.data()};
+    float *age = pool.age.data();
+    for (int i = 0; i < n; ++i) {
+      pv[1][i] -= g * dt;
+      age[i] += dt;
+    }
+    // same walls as Object::boxCheck
+    for (int k = 0; k < 3; ++k) {
+      float offset = k == 2 ? -3 * boxSize : 0;
+      float lo = offset - boxSize, hi = offset + boxSize, e = cofRes;
+      float *p = px[k], *v = pv[k];
+      for (int i = 0; i < n; ++i) {
+        p[i] += v[i] * dt;
+        float a = abs(v[i]) * e;
+        v[i] = p[i] <= lo ? a : (p[i] >= hi ? -a : v[i]);
+        p[i] = min(max(p[i], lo), hi);
+      }
+    }
+    for (int i = 0; i < pool.count;) {
+      if (pool.age[i] >= pool.life[i]) {
+        pool.kill(i);
+      } else {
+        ++i;
+      }
+    }
+
+    pending += rate * deltaT;
+    normal_distribution<float> jitter(0, spread);
+    for (; pending >= 1; pending -= 1) {
+      int i = pool.spawn();
+      if (i < 0) {
+        pending = 0;
+        break;
+      }
+      pool.x[i] = pos[0];
+      pool.y[i] = pos[1];
+      pool.z[i] = pos[2];
+      pool.vx[i] = v[0] + jitter(rng);
+      pool.vy[i] = v[1] + jitter(rng);
+      pool.vz[i] = v[2] + jitter(rng);
+      pool.age[i] = 0;
+      pool.life[i] = lifetime;
+    }
+    pool.fillVertices();
+  }
+};
+
+} // namespace ICG
@@ -0,0 +1,352 @@
+#pragma once
+
+#include "SystemDS.h"
+
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <vector>
+
+using namespace std;
+
+namespace ICG {
+
+// Event-driven hard-sphere engine. Every ball moves on a closed-form
+// trajectory (a parabola under gravity, or a straight line once it rests on
+// the floor) between events, and the exact time of the next ball-ball or
+// ball-wall event is kept in a priority queue. Balls never tunnel, and
+// sparse scenes only pay for the events that actually happen.
+//
+// Hard spheres have no rolling friction, so balls resting on the floor slide
+// until they hit something.
+class EventEngine {
+public:
+  struct Ball {
+    // trajectory reference, the ball is at p0 with velocity v0 at time t0
+    double t0{0};
+    vec3 p0;
+    vec3 v0;
+    bool resting{false};
+    // bumped on every change so stale events can be dropped
+    int count{0};
+    // time of the next wall event, bounds the pair search
+    double tWall;
+  };
+
+  struct Event {
+    double t;
+    int a, b; // b < 0 is the wall -1 - b
+    int countA, countB;
+    bool operator>(const Event &other) const {
+      if (t != other.t) {
+        return t > other.t;
+      }
+      if (a != other.a) {
+        return a > other.a;
+      }
+      return b > other.b;
+    }
+  };
+
+  // a bounce slower than this would stay below a millimeter, so the ball
+  // is put to rest instead of bouncing forever
+  const double restVelocity{sqrt(2 * Object::g * Object::eps)};
+
+  double time{0};
+  vector<Ball> balls;
+  priority_queue<Event, vector<Event>, greater<Event>> events;
+
+  void init(const FrameSystem &fs) {
+    time = 0;
+    balls.assign(fs.objects.size(), Ball());
+    for (size_t i = 0; i < balls.size(); ++i) {
+      auto &ball = balls[i];
+      auto &object = fs.objects[i];
+      ball.p0 = object->pos;
+      ball.v0 = object->v;
+      double lo, hi;
+      wallLimits(fs, i, 1, lo, hi);
+      ball.resting = ball.p0[1] <= lo + Object::eps &&
+                     abs(ball.v0[1]) < restVelocity;
+      if (ball.resting) {
+        ball.p0[1] = lo;
+        ball.v0[1] = 0;
+      }
+    }
+    rebuild(fs);
+  }
+
+  // re-predict every event from the current trajectories
+  void rebuild(const FrameSystem &fs) {
+    events = priority_queue<Event, vector<Event>, greater<Event>>();
+    for (size_t i = 0; i < balls.size(); ++i) {
+      predictWall(fs, i);
+    }
+    for (size_t i = 0; i < balls.size(); ++i) {
+      for (size_t j = i + 1; j < balls.size(); ++j) {
+        predictPair(fs, i, j);
+      }
+    }
+  }
+
+  // A ball whose velocity was changed outside the engine since the last
+  // frame, by a cloth pushing it, leaves its trajectory there. Its events
+  // are predicted again from the new velocity.
+  void resync(const FrameSystem &fs) {
+    vector<int> touched;
+    for (size_t i = 0; i < balls.size(); ++i) {
+      const auto &v = fs.objects[i]->v;
+      if (v == velocity(i, time)) {
+        continue;
+      }
+      rebase(i);
+      auto &ball = balls[i];
+      ball.v0 = v;
+      // a push up lifts a ball off the floor, one along it keeps it there
+      if (ball.resting && ball.v0[1] > 0) {
+        ball.resting = false;
+      } else if (ball.resting) {
+        ball.v0[1] = 0;
+      }
+      touched.emplace_back(i);
+    }
+    for (int i : touched) {
+      predict(fs, i);
+    }
+  }
+
+  void advance(FrameSystem &fs, double deltaT) {
+    double target = time + deltaT;
+    while (!events.empty() && events.top().t <= target) {
+      Event event = events.top();
+      events.pop();
+      if (balls[event.a].count != event.countA ||
+          (event.b >= 0 && balls[event.b].count != event.countB)) {
+        continue;
+      }
+      time = max(time, event.t);
+      if (event.b < 0) {
+        bounceWall(fs, event.a, -1 - event.b);
+        predict(fs, event.a);
+      } else {
+        collide(fs, event.a, event.b);
+        predict(fs, event.a);
+        predict(fs, event.b);
+      }
+    }
+    time = target;
+    for (size_t i = 0; i < balls.size(); ++i) {
+      auto &object = fs.objects[i];
+      object->pos = position(i, time);
+      object->v = velocity(i, time);
+      object->calFrame();
+    }
+  }
+
+  vec3 position(int i, double t) const {
+    const auto &ball = balls[i];
+    double tau = t - ball.t0;
+    vec3 pos;
+    for (int k = 0; k < 3; ++k) {
+      pos[k] = ball.p0[k] + ball.v0[k] * tau;
+    }
+    if (!ball.resting) {
+      pos[1] -= 0.5 * Object::g * tau * tau;
+    }
+    return pos;
+  }
+
+  vec3 velocity(int i, double t) const {
+    const auto &ball = balls[i];
+    vec3 vel = ball.v0;
+    if (!ball.resting) {
+      vel[1] -= Object::g * (t - ball.t0);
+    }
+    return vel;
+  }
+
+private:
+  static double dot(const vec3 &a, const vec3 &b) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+  }
+
+  // range of the center of ball i along axis, same walls as boxCheck
+  static void wallLimits(const FrameSystem &fs, int i, int axis, double &lo,
+                         double &hi) {
+    double offset = axis == 2 ? -3 * fs.boxSize : 0;
+    lo = offset - fs.boxSize + fs.objects[i]->radius;
+    hi = offset + fs.boxSize - fs.objects[i]->radius;
+  }
+
+  // restart the trajectory of ball i at the current time
+  void rebase(int i) {
+    auto &ball = balls[i];
+    ball.p0 = position(i, time);
+    ball.v0 = velocity(i, time);
+    ball.t0 = time;
+    ball.count++;
+  }
+
+  void predict(const FrameSystem &fs, int i) {
+    predictWall(fs, i);
+    for (size_t j = 0; j < balls.size(); ++j) {
+      if ((int)j != i) {
+        predictPair(fs, min<int>(i, j), max<int>(i, j));
+      }
+    }
+  }
+
+  void predictWall(const FrameSystem &fs, int i) {
+    auto &ball = balls[i];
+    double best = numeric_limits<double>::infinity();
+    int wall = -1;
+    for (int k = 0; k < 3; ++k) {
+      double lo, hi, tau = numeric_limits<double>::infinity();
+      wallLimits(fs, i, k, lo, hi);
+      double p = ball.p0[k], v = ball.v0[k];
+      int side = 0;
+      if (k == 1 && !ball.resting) {
+        // falling, p - g/2 tau^2 + v tau = lo always has a positive root
+        const double g = Object::g;
+        tau = (v + sqrt(max(0.0, v * v + 2 * g * (p - lo)))) / g;
+        double disc = v * v - 2 * g * (hi - p);
+        if (v > 0 && disc >= 0) {
+          tau = (v - sqrt(disc)) / g;
+          side = 1;
+        }
+      } else if (v > 0) {
+        tau = max(0.0, (hi - p) / v);
+        side = 1;
+      } else if (v < 0) {
+        tau = max(0.0, (lo - p) / v);
+      }
+      if (tau < best) {
+        best = tau;
+        wall = k * 2 + side;
+      }
+    }
+    ball.tWall = ball.t0 + best;
+    if (wall >= 0) {
+      events.push(Event{ball.tWall, i, -1 - wall, ball.count, 0});
+    }
+  }
+
+  // Predicted from the reference trajectories only, so the same two balls
+  // always give the same event no matter when the prediction is made.
+  void predictPair(const FrameSystem &fs, int i, int j) {
+    const auto &a = balls[i], &b = balls[j];
+    double radius = fs.objects[i]->radius + fs.objects[j]->radius;
+    double start = max(a.t0, b.t0);
+    double t = numeric_limits<double>::infinity();
+    vec3 dp, dv;
+    auto relative = [&](double at) {
+      auto pa = position(i, at), pb = position(j, at);
+      auto va = velocity(i, at), vb = velocity(j, at);
+      for (int k = 0; k < 3; ++k) {
+        dp[k] = pb[k] - pa[k];
+        dv[k] = vb[k] - va[k];
+      }
+    };
+    relative(start);
+
+    if (a.resting == b.resting) {
+      // same acceleration, the relative motion is a straight line
+      double bb = dot(dp, dv), dvv = dot(dv, dv);
+      double disc = bb * bb - dvv * (dot(dp, dp) - radius * radius);
+      if (bb < 0 && disc >= 0) {
+        t = start + max(0.0, -(bb + sqrt(disc)) / dvv);
+      }
+    } else {
+      // one ball falls past the other, step forward by the shortest time
+      // the gap could possibly close in until the faller hits a wall
+      double horizon = a.resting ? b.tWall : a.tWall;
+      const double g = Object::g;
+      double at = start;
+      for (int iter = 0; iter < 64 && at < horizon; ++iter) {
+        relative(at);
+        double gap = sqrt(dot(dp, dp)) - radius;
+        if (gap < 1e-9 && dot(dp, dv) < 0) {
+          t = at;
+          break;
+        }
+        gap = max(gap, 1e-9);
+        double speed = sqrt(dot(dv, dv));
+        at += 2 * gap / (speed + sqrt(speed * speed + 4 * g * gap));
+      }
+      if (t > horizon && at < horizon) {
+        // not converged yet, check again from there
+        t = at;
+      }
+    }
+    if (t < numeric_limits<double>::infinity()) {
+      events.push(Event{t, i, j, a.count, b.count});
+    }
+  }
+
+  void bounceWall(const FrameSystem &fs, int i, int wall) {
+    rebase(i);
+    auto &ball = balls[i];
+    int axis = wall / 2;
+    double lo, hi, cofRes = fs.objects[i]->cofRes;
+    wallLimits(fs, i, axis, lo, hi);
+    if (wall % 2) {
+      ball.p0[axis] = hi;
+      ball.v0[axis] = -abs(ball.v0[axis]) * cofRes;
+    } else {
+      ball.p0[axis] = lo;
+      ball.v0[axis] = abs(ball.v0[axis]) * cofRes;
+    }
+    if (abs(ball.v0[axis]) < Object::eps) {
+      ball.v0[axis] = 0;
+    }
+    if (wall == 2 && ball.v0[1] < restVelocity) {
+      ball.resting = true;
+      ball.v0[1] = 0;
+    }
+  }
+
+  void collide(const FrameSystem &fs, int i, int j) {
+    rebase(i);
+    rebase(j);
+    auto &a = balls[i], &b = balls[j];
+    vec3 n;
+    for (int k = 0; k < 3; ++k) {
+      n[k] = b.p0[k] - a.p0[k];
+    }
+    double len = sqrt(dot(n, n));
+    double radius = fs.objects[i]->radius + fs.objects[j]->radius;
+    if (len > radius + 1e-6) {
+      // a check point of the pair search, not a contact yet
+      return;
+    }
+    for (auto &x : n) {
+      x /= len;
+    }
+    vec3 dv;
+    for (int k = 0; k < 3; ++k) {
+      dv[k] = b.v0[k] - a.v0[k];
+    }
+    double vn = dot(dv, n);
+    if (vn >= 0) {
+      return;
+    }
+    double ma = fs.objects[i]->mass, mb = fs.objects[j]->mass;
+    double cofRes = (fs.objects[i]->cofRes + fs.objects[j]->cofRes) / 2;
+    double impulse = -(1 + cofRes) * vn / (1 / ma + 1 / mb);
+    for (int k = 0; k < 3; ++k) {
+      a.v0[k] -= impulse / ma * n[k];
+      b.v0[k] += impulse / mb * n[k];
+    }
+    // a resting ball is held up by the floor unless it is knocked upwards
+    for (auto ball : {&a, &b}) {
+      if (ball->resting && ball->v0[1] > restVelocity) {
+        ball->resting = false;
+      } else if (ball->resting) {
+        ball->v0[1] = 0;
+      }
+    }
+  }
+};
+
+} // namespace ICG
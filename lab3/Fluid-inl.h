@@ -0,0 +1,278 @@
+#pragma once
+
+#include "SystemDS.h"
+#include "ThreadPool-inl.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+
+namespace ICG {
+
+// Smoothed-particle hydrodynamics fluid held by the lab3 box, using the
+// poly6 / spiky / viscosity kernels of Mueller et al. 2003. Every substep
+// the particles are counting-sorted into a grid of kernel-radius cells, so
+// a neighbor search touches at most 27 cells of contiguous particles. The
+// density, force and integration passes run on the thread pool and each
+// writes only the particles it owns. Balls in the same box push the fluid
+// out of their volume and take the opposite impulse.
+class Fluid {
+public:
+  // kernel radius, particles start on a lattice of half that spacing
+  double h;
+  double restDensity;
+  double stiffness;
+  double viscosity;
+  int substeps{4};
+  double cofRes{0.3};
+
+  int count{0};
+  float mass{0};
+  vector<float> x, y, z;
+  vector<float> vx, vy, vz;
+  vector<float> density, pressure;
+  vector<float> ax, ay, az;
+  // interleaved positions handed to glDrawArrays
+  vector<float> vertices;
+
+  // fill the box [lo, hi] with particles at rest
+  void fill(const vec3 &lo, const vec3 &hi) {
+    double spacing = h / 2;
+    mass = restDensity * spacing * spacing * spacing;
+    for (double px = lo[0]; px <= hi[0]; px += spacing) {
+      for (double py = lo[1]; py <= hi[1]; py += spacing) {
+        for (double pz = lo[2]; pz <= hi[2]; pz += spacing) {
+          x.emplace_back(px);
+          y.emplace_back(py);
+          z.emplace_back(pz);
+        }
+      }
+    }
+    count = x.size();
+    for (auto array : {&vx, &vy, &vz, &density, &pressure, &ax, &ay, &az}) {
+      array->assign(count, 0);
+    }
+    vertices.assign(count * 3, 0);
+    fillVertices();
+  }
+
+  // with coupled set the balls also take the impulse of the fluid, otherwise
+  // they are static obstacles
+  void update(double deltaT, FrameSystem &fs, ThreadPool &threads,
+              bool coupled) {
+    double dt = deltaT / substeps;
+    for (int s = 0; s < substeps; ++s) {
+      sortIntoGrid(fs.boxSize);
+      threads.parallelFor(count, kChunk, [&](int begin, int end) {
+        calDensity(begin, end);
+      });
+      threads.parallelFor(count, kChunk, [&](int begin, int end) {
+        calForce(begin, end);
+      });
+      threads.parallelFor(count, kChunk, [&](int begin, int end) {
+        integrate(begin, end, dt, fs.boxSize);
+      });
+      pushOutOfBalls(fs, coupled);
+    }
+    fillVertices();
+  }
+
+  void fillVertices() {
+    for (int i = 0; i < count; ++i) {
+      vertices[i * 3] = x[i];
+      vertices[i * 3 + 1] = y[i];
+      vertices[i * 3 + 2] = z[i];
+    }
+  }
+
+private:
+  static const int kChunk = 1024;
+
+  // neighbor grid, particles of cell c are [cellStart[c], cellStart[c + 1])
+  int dims[3];
+  float origin[3];
+  vector<int> cellOf, cellStart;
+  vector<float> scratch;
+
+  int clampCell(float p, int axis) const {
+    int c = (p - origin[axis]) / h;
+    return min(max(c, 0), dims[axis] - 1);
+  }
+
+  void sortIntoGrid(double boxSize) {
+    origin[0] = -boxSize;
+    origin[1] = -boxSize;
+    origin[2] = -4 * boxSize;
+    for (int k = 0; k < 3; ++k) {
+      dims[k] = max(1, (int)ceil(2 * boxSize / h));
+    }
+    int cells = dims[0] * dims[1] * dims[2];
+    cellOf.resize(count);
+    cellStart.assign(cells + 1, 0);
+    for (int i = 0; i < count; ++i) {
+      cellOf[i] = (clampCell(x[i], 0) * dims[1] + clampCell(y[i], 1)) *
+                      dims[2] +
+                  clampCell(z[i], 2);
+      cellStart[cellOf[i] + 1]++;
+    }
+    for (int c = 0; c < cells; ++c) {
+      cellStart[c + 1] += cellStart[c];
+    }
+    // move particles so every cell is one contiguous run
+    vector<int> slot(cellStart.begin(), cellStart.end() - 1);
+    vector<int> target(count);
+    for (int i = 0; i < count; ++i) {
+      target[i] = slot[cellOf[i]]++;
+    }
+    scratch.resize(count);
+    for (auto array : {&x, &y, &z, &vx, &vy, &vz}) {
+      for (int i = 0; i < count; ++i) {
+        scratch[target[i]] = (*array)[i];
+      }
+      array->swap(scratch);
+    }
+  }
+
+  // visit the particles in the 27 cells around particle i as 9 contiguous
+  // ranges, one per column of three cells
+  template <typename Func> void forNeighbors(int i, Func func) const {
+    int cx = clampCell(x[i], 0), cy = clampCell(y[i], 1),
+        cz = clampCell(z[i], 2);
+    for (int gx = max(cx - 1, 0); gx <= min(cx + 1, dims[0] - 1); ++gx) {
+      for (int gy = max(cy - 1, 0); gy <= min(cy + 1, dims[1] - 1); ++gy) {
+        int row = (gx * dims[1] + gy) * dims[2];
+        func(cellStart[row + max(cz - 1, 0)],
+             cellStart[row + min(cz + 1, dims[2] - 1) + 1]);
+      }
+    }
+  }
+
+  void calDensity(int begin, int end) {
+    const float h2 = h * h;
+    const float poly6 = 315.0 / (64.0 * PI * pow(h, 9));
+    const float *px = x.data(), *py = y.data(), *pz = z.data();
+    for (int i = begin; i < end; ++i) {
+      float sum = 0;
+      forNeighbors(i, [&](int first, int last) {
+        for (int j = first; j < last; ++j) {
+          float dx = px[j] - px[i], dy = py[j] - py[i], dz = pz[j] - pz[i];
+          float w = max(h2 - (dx * dx + dy * dy + dz * dz), 0.0f);
+          sum += w * w * w;
+        }
+      });
+      density[i] = mass * poly6 * sum;
+      // no negative pressure, it would make the surface clump
+      pressure[i] = max(0.0f, (float)(stiffness * (density[i] - restDensity)));
+    }
+  }
+
+  void calForce(int begin, int end) {
+    const float hh = h;
+    const float spiky = -45.0 / (PI * pow(h, 6));
+    const float laplacian = 45.0 / (PI * pow(h, 6));
+    const float mu = viscosity;
+    const float *px = x.data(), *py = y.data(), *pz = z.data();
+    const float *pvx = vx.data(), *pvy = vy.data(), *pvz = vz.data();
+    const float *rho = density.data(), *p = pressure.data();
+    for (int i = begin; i < end; ++i) {
+      float fx = 0, fy = 0, fz = 0;
+      forNeighbors(i, [&](int first, int last) {
+        for (int j = first; j < last; ++j) {
+          float dx = px[i] - px[j], dy = py[i] - py[j], dz = pz[i] - pz[j];
+          float r2 = dx * dx + dy * dy + dz * dz;
+          if (j == i || r2 >= hh * hh) {
+            continue;
+          }
+          float r = sqrt(r2) + 1e-6f;
+          float q = hh - r;
+          // pressure pushes along i - j, viscosity pulls velocities together
+          float fp =
+              -mass * (p[i] + p[j]) / (2 * rho[j]) * spiky * q * q / r;
+          float fv = mu * mass * laplacian * q / rho[j];
+          fx += fp * dx + fv * (pvx[j] - pvx[i]);
+          fy += fp * dy + fv * (pvy[j] - pvy[i]);
+          fz += fp * dz + fv * (pvz[j] - pvz[i]);
+        }
+      });
+      ax[i] = fx / rho[i];
+      ay[i] = fy / rho[i] - Object::g;
+      az[i] = fz / rho[i];
+    }
+  }
+
+  void integrate(int begin, int end, double deltaT, double boxSize) {
+    float dt = deltaT;
+    float *p[3] = {x.data(), y.data(), z.data()};
+    float *v[3] = {vx.data(), vy.data(), vz.data()};
+    float *a[3] = {ax.data(), ay.data(), az.data()};
+    // same walls as Object::boxCheck
+    for (int k = 0; k < 3; ++k) {
+      float offset = k == 2 ? -3 * boxSize : 0;
+      float lo = offset - boxSize, hi = offset + boxSize, e = cofRes;
+      for (int i = begin; i < end; ++i) {
+        v[k][i] += a[k][i] * dt;
+        p[k][i] += v[k][i] * dt;
+        float bounce = abs(v[k][i]) * e;
+        v[k][i] = p[k][i] <= lo ? bounce : (p[k][i] >= hi ? -bounce : v[k][i]);
+        p[k][i] = min(max(p[k][i], lo), hi);
+      }
+    }
+  }
+
+  // keep particles out of the balls, the ball takes the momentum the
+  // particles lose
+  void pushOutOfBalls(FrameSystem &fs, bool coupled) {
+    for (size_t id = 0; id < fs.objects.size(); ++id) {
+      const auto &object = fs.objects[id];
+      float r = object->radius;
+      int lo[3], hi[3];
+      for (int k = 0; k < 3; ++k) {
+        lo[k] = clampCell(object->pos[k] - r - h, k);
+        hi[k] = clampCell(object->pos[k] + r + h, k);
+      }
+      vec3 impulse{0, 0, 0};
+      for (int gx = lo[0]; gx <= hi[0]; ++gx) {
+        for (int gy = lo[1]; gy <= hi[1]; ++gy) {
+          int row = (gx * dims[1] + gy) * dims[2];
+          for (int j = cellStart[row + lo[2]]; j < cellStart[row + hi[2] + 1];
+               ++j) {
+            float d[3] = {x[j] - (float)object->pos[0],
+                          y[j] - (float)object->pos[1],
+                          z[j] - (float)object->pos[2]};
+            float len = sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+            if (len >= r || len < 1e-6f) {
+              continue;
+            }
+            float *p[3] = {&x[j], &y[j], &z[j]};
+            float *v[3] = {&vx[j], &vy[j], &vz[j]};
+            float vn = 0;
+            for (int k = 0; k < 3; ++k) {
+              d[k] /= len;
+              *p[k] = object->pos[k] + d[k] * r;
+              vn += (*v[k] - object->v[k]) * d[k];
+            }
+            if (vn >= 0) {
+              continue;
+            }
+            for (int k = 0; k < 3; ++k) {
+              *v[k] -= (1 + cofRes) * vn * d[k];
+              impulse[k] += mass * (1 + cofRes) * vn * d[k];
+            }
+          }
+        }
+      }
+      if (coupled && (impulse[0] || impulse[1] || impulse[2])) {
+        if (object->sleeping) {
+          fs.wake(id);
+        }
+        for (int k = 0; k < 3; ++k) {
+          object->v[k] += impulse[k] / object->mass;
+        }
+      }
+    }
+  }
+};
+
+} // namespace ICG
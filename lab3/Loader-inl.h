@@ -1,7 +1,12 @@
 #pragma once
 
+#include "BVH-inl.h"
+#include "Cloth-inl.h"
+#include "Emitter-inl.h"
+#include "Fluid-inl.h"
 #include "Frame-inl.h"
 #include "MatrixOp-inl.h"
+#include "PoissonDisk-inl.h"
 #include "SystemDS.h"
 
 #include <GLUT/glut.h>
@@ -10,6 +15,7 @@
 #include <fstream>
 #include <glog/logging.h>
 #include <iostream>
+#include <random>
 #include <sstream>
 #include <string>
 #include <unordered_map>
@@ -42,8 +48,10 @@ struct Face {
 
 class Loader {
 public:
+  // loadModels false skips every GL call, for running without a window
   static bool loadDesFile(const string &fileName,
-                          const shared_ptr<FrameSystem> fSystem) {
+                          const shared_ptr<FrameSystem> fSystem,
+                          bool loadModels = true) {
     ifstream desFile(fileName, ios::in | ios::binary);
     // check if opened correctl
     if (not desFile.is_open()) {
@@ -64,6 +72,50 @@ public:
         continue;
       } else if (token == "dt") {
         lineStream >> fSystem->deltaT;
+      } else if (token == "engine") {
+        string engine;
+        lineStream >> engine;
+        if (engine == "event") {
+          fSystem->engine = ENGINE_EVENT;
+        } else if (engine == "step") {
+          fSystem->engine = ENGINE_STEP;
+        } else {
+          LOG(FATAL) << "Unknow engine " << engine;
+        }
+      } else if (token == "integrator") {
+        // name [max-move max-substeps tolerance]
+        string name;
+        lineStream >> name;
+        auto &integrator = fSystem->integrator;
+        if (name == "trapezoid") {
+          integrator.type = INTEGRATOR_TRAPEZOID;
+        } else if (name == "euler") {
+          integrator.type = INTEGRATOR_EULER;
+        } else if (name == "verlet") {
+          integrator.type = INTEGRATOR_VERLET;
+        } else if (name == "adaptive") {
+          integrator.type = INTEGRATOR_ADAPTIVE;
+        } else {
+          LOG(FATAL) << "Unknow integrator " << name;
+        }
+        double maxMove, tolerance;
+        int maxSubsteps;
+        if (lineStream >> maxMove) {
+          integrator.maxMove = maxMove;
+        }
+        if (lineStream >> maxSubsteps) {
+          integrator.maxSubsteps = maxSubsteps;
+        }
+        if (lineStream >> tolerance) {
+          integrator.tolerance = tolerance;
+        }
+      } else if (token == "sleep") {
+        // quiet-time [sleep-velocity], a quiet-time of 0 disables sleeping
+        double sleepVelocity;
+        lineStream >> fSystem->sleepTime;
+        if (lineStream >> sleepVelocity) {
+          fSystem->sleepVelocity = sleepVelocity;
+        }
       } else if (token == "box") {
         lineStream >> fSystem->boxSize;
         fSystem->boxObj = make_shared<Object>();
@@ -71,8 +123,82 @@ public:
         fSystem->boxObj->pos[1] = -fSystem->boxSize;
         fSystem->boxObj->pos[2] = -fSystem->boxSize * 2;
         fSystem->boxObj->calFrame();
-        fSystem->boxObj->modelID =
-            loadObjFromFile("../files/box.obj", fSystem->boxSize*2);
+        if (loadModels) {
+          fSystem->boxObj->modelID =
+              loadObjFromFile("../files/box.obj", fSystem->boxSize * 2);
+        }
+      } else if (token == "emitter") {
+        auto emitter = make_shared<Emitter>();
+        int capacity;
+        // rate lifetime size max-particles px py pz vx vy vz spread [cofRes]
+        lineStream >> emitter->rate >> emitter->lifetime >> emitter->size >>
+            capacity >> emitter->pos[0] >> emitter->pos[1] >>
+            emitter->pos[2] >> emitter->v[0] >> emitter->v[1] >>
+            emitter->v[2] >> emitter->spread;
+        double cofRes;
+        if (lineStream >> cofRes) {
+          emitter->cofRes = cofRes;
+        }
+        emitter->rng.seed(fSystem->emitters.size());
+        emitter->pool.reserve(capacity);
+        fSystem->emitters.emplace_back(emitter);
+      } else if (token == "fluid") {
+        auto fluid = make_shared<Fluid>();
+        vec3 lo, hi;
+        // h rest-density stiffness viscosity substeps x0 y0 z0 x1 y1 z1,
+        // the block [x0, x1] x [y0, y1] x [z0, z1] starts filled at rest
+        lineStream >> fluid->h >> fluid->restDensity >> fluid->stiffness >>
+            fluid->viscosity >> fluid->substeps >> lo[0] >> lo[1] >> lo[2] >>
+            hi[0] >> hi[1] >> hi[2];
+        if (fluid->h <= 0 || fluid->substeps < 1) {
+          LOG(FATAL) << "Bad fluid line: " << line;
+        }
+        fluid->fill(lo, hi);
+        fSystem->fluid = fluid;
+        if (!fSystem->threadPool) {
+          fSystem->threadPool = make_shared<ThreadPool>();
+        }
+      } else if (token == "cloth") {
+        auto cloth = make_shared<Cloth>();
+        vec3 origin;
+        int pinCorners = 0;
+        // nx ny spacing substeps iterations stiffness bend-stiffness mass
+        // px py pz [pin-corners]
+        lineStream >> cloth->nx >> cloth->ny >> cloth->spacing >>
+            cloth->substeps >> cloth->iterations >> cloth->stiffness >>
+            cloth->bendStiffness >> cloth->mass >> origin[0] >> origin[1] >>
+            origin[2];
+        lineStream >> pinCorners;
+        if (cloth->nx < 2 || cloth->ny < 2 || cloth->substeps < 1 ||
+            cloth->iterations < 1) {
+          LOG(FATAL) << "Bad cloth line: " << line;
+        }
+        cloth->build(origin, pinCorners);
+        fSystem->cloths.emplace_back(cloth);
+        if (!fSystem->threadPool) {
+          fSystem->threadPool = make_shared<ThreadPool>();
+        }
+      } else if (token == "mesh") {
+        string objFile;
+        double scalar;
+        auto mesh = make_shared<CollisionMesh>();
+        mesh->model = make_shared<Object>();
+        auto &pos = mesh->model->pos;
+        // filename scalar px py pz
+        lineStream >> objFile >> scalar >> pos[0] >> pos[1] >> pos[2];
+        vector<Triangle> triangles;
+        if (!loadTrianglesFromFile(objFile, scalar, pos, triangles)) {
+          LOG(FATAL) << "Cannot load collision mesh: " << objFile;
+        }
+        if (!fSystem->threadPool) {
+          fSystem->threadPool = make_shared<ThreadPool>();
+        }
+        mesh->bvh.build(move(triangles), *fSystem->threadPool);
+        mesh->model->calFrame();
+        if (loadModels) {
+          mesh->model->modelID = loadObjFromFile(objFile, scalar);
+        }
+        fSystem->meshes.emplace_back(mesh);
       } else if (token == "object") {
         string objFile;
         shared_ptr<Object> newObj = make_shared<Object>();
@@ -84,8 +210,93 @@ public:
             newObj->pos[2];
 
         newObj->calFrame();
-        newObj->modelID = loadObjFromFile(objFile, scalar);
+        if (loadModels) {
+          newObj->modelID = loadObjFromFile(objFile, scalar);
+        }
         fSystem->objects.emplace_back(newObj);
+      } else if (token == "balls") {
+        string objFile;
+        auto ball = make_shared<Object>();
+        double scalar, spacing;
+        vec3 lo, hi;
+        size_t count = SIZE_MAX;
+        // filename radius scalar mass friction cofRes vx vy vz spacing x0 y0
+        // z0 x1 y1 z1 [count], balls at least spacing apart fill the block
+        // [x0, x1] x [y0, y1] x [z0, z1] from its center
+        lineStream >> objFile >> ball->radius >> scalar >> ball->mass >>
+            ball->friction >> ball->cofRes >> ball->v[0] >> ball->v[1] >>
+            ball->v[2] >> spacing >> lo[0] >> lo[1] >> lo[2] >> hi[0] >>
+            hi[1] >> hi[2];
+        size_t limit;
+        if (lineStream >> limit) {
+          count = limit;
+        }
+        if (spacing < 2 * ball->radius) {
+          LOG(FATAL) << "Bad balls line: " << line;
+        }
+        mt19937 rng(fSystem->objects.size());
+        uniform_real_distribution<double> uniform;
+        vec3 center;
+        for (int k = 0; k < 3; ++k) {
+          center[k] = (lo[k] + hi[k]) / 2;
+        }
+        auto placed = PoissonDisk::sample(lo, hi, spacing, center, count,
+                                          [&] { return uniform(rng); });
+        if (loadModels && !placed.empty()) {
+          ball->modelID = loadObjFromFile(objFile, scalar);
+        }
+        for (const auto &p : placed) {
+          auto newObj = make_shared<Object>(*ball);
+          newObj->pos = p;
+          newObj->calFrame();
+          fSystem->objects.emplace_back(newObj);
+        }
+      }
+    }
+    return true;
+  }
+
+  // triangles of an OBJ file scaled and moved to offset, polygons are split
+  // into fans
+  static bool loadTrianglesFromFile(const string &fileName,
+                                    const double scalar, const vec3 &offset,
+                                    vector<Triangle> &triangles) {
+    ifstream objFile(fileName, ios::in | ios::binary);
+    if (not objFile.is_open()) {
+      LOG(ERROR) << "Cannot open obj file: " << fileName;
+      return false;
+    }
+    vector<vec3> points;
+    string line;
+    while (getline(objFile, line)) {
+      istringstream lineStream(line);
+      string token;
+      lineStream >> token;
+      if (token == "v") {
+        vec3 point;
+        lineStream >> point[0] >> point[1] >> point[2];
+        for (int k = 0; k < 3; ++k) {
+          point[k] = point[k] * scalar + offset[k];
+        }
+        points.emplace_back(point);
+      } else if (token == "f") {
+        vector<int> face;
+        while (lineStream >> token) {
+          istringstream tokenStream(token);
+          int index;
+          tokenStream >> index;
+          // negative indices count back from the last vertex
+          index = index < 0 ? points.size() + index : index - 1;
+          if (index < 0 || index >= (int)points.size()) {
+            LOG(ERROR) << "Bad face in obj file: " << fileName;
+            return false;
+          }
+          face.emplace_back(index);
+        }
+        for (size_t i = 2; i < face.size(); ++i) {
+          triangles.push_back(
+              {points[face[0]], points[face[i - 1]], points[face[i]]});
+        }
       }
     }
     return true;
@@ -0,0 +1,337 @@
+#pragma once
+
+#include "SystemDS.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ICG_NARROWPHASE_AVX2 1
+#endif
+
+using namespace std;
+
+namespace ICG {
+
+// Sphere-sphere narrowphase over the broadphase pairs. Every body is copied
+// into two packed records once per check, so a pair reads one record per
+// body instead of chasing the Object. Pairs are tested kLanes at a time
+// with squared distances and only the ones in contact are kept. The
+// overlapping ones are scheduled into waves where no body appears twice,
+// then every wave is resolved kLanes pairs at a time: the records are
+// gathered and transposed, the per-axis impulse is computed for all lanes
+// at once and the velocities are scattered back. A body takes part in its
+// pairs in the original order, so the result equals resolving the pairs
+// one by one. The AVX2 kernels are picked at runtime and the scalar ones do
+// the same arithmetic.
+class Narrowphase {
+public:
+  static const int kLanes = 8;
+  // bits of hitFlags
+  static const uint8_t kOverlap = 1;
+  static const uint8_t kContact = 2;
+
+  struct Sphere {
+    double x, y, z, radius;
+  };
+  struct Body {
+    double vx, vy, vz, mass;
+  };
+  vector<Sphere> spheres;
+  vector<Body> bodies;
+  vector<double> cofRes;
+  vector<uint8_t> asleep;
+  // pairs of the last test that are in contact, in order, and their flags
+  vector<int> hits;
+  vector<uint8_t> hitFlags;
+
+  Narrowphase() {
+#ifdef ICG_NARROWPHASE_AVX2
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+  }
+
+  void load(const vector<shared_ptr<Object>> &objects) {
+    int n = objects.size();
+    spheres.resize(n);
+    bodies.resize(n);
+    cofRes.resize(n);
+    touched.assign(n, 0);
+    moved.assign(n, 0);
+    for (int i = 0; i < n; ++i) {
+      const auto &object = *objects[i];
+      spheres[i] = {object.pos[0], object.pos[1], object.pos[2],
+                    object.radius};
+      bodies[i] = {object.v[0], object.v[1], object.v[2], object.mass};
+      cofRes[i] = object.cofRes;
+    }
+    loadSleeping(objects);
+  }
+
+  // after FrameSystem::wake
+  void loadSleeping(const vector<shared_ptr<Object>> &objects) {
+    asleep.resize(objects.size());
+    for (size_t i = 0; i < objects.size(); ++i) {
+      asleep[i] = objects[i]->sleeping;
+    }
+  }
+
+  // a collided body leaves with av equal to v
+  void store(const vector<shared_ptr<Object>> &objects) const {
+    for (size_t i = 0; i < objects.size(); ++i) {
+      if (touched[i]) {
+        const auto &b = bodies[i];
+        objects[i]->v = objects[i]->av = {b.vx, b.vy, b.vz};
+      }
+      if (moved[i]) {
+        const auto &a = spheres[i];
+        objects[i]->pos = {a.x, a.y, a.z};
+      }
+    }
+  }
+
+  // overlap when the gap is below -1e-3, contact when it is below 0.1
+  void test(const vector<pair<int, int>> &input) {
+    pairs = &input;
+    hits.clear();
+    hitFlags.clear();
+    int n = input.size(), p = 0;
+#ifdef ICG_NARROWPHASE_AVX2
+    if (avx2) {
+      for (; p + kLanes <= n; p += kLanes) {
+        testAVX2(p);
+      }
+    }
+#endif
+    for (; p < n; ++p) {
+      testScalar(p);
+    }
+  }
+
+  // resolve the overlapping pairs in segment, which only holds awake bodies
+  void resolve(const vector<int> &segment) {
+    if (segment.empty()) {
+      return;
+    }
+    // a pair goes one wave after the last wave of either of its bodies
+    const auto &ps = *pairs;
+    int waves = 0;
+    wave.resize(segment.size());
+    lastWave.resize(bodies.size(), -1);
+    for (size_t s = 0; s < segment.size(); ++s) {
+      int i = ps[segment[s]].first, j = ps[segment[s]].second;
+      wave[s] = max(lastWave[i], lastWave[j]) + 1;
+      lastWave[i] = lastWave[j] = wave[s];
+      waves = max(waves, wave[s] + 1);
+    }
+    waveStart.assign(waves + 1, 0);
+    for (size_t s = 0; s < segment.size(); ++s) {
+      waveStart[wave[s] + 1]++;
+      lastWave[ps[segment[s]].first] = lastWave[ps[segment[s]].second] = -1;
+    }
+    for (int w = 0; w < waves; ++w) {
+      waveStart[w + 1] += waveStart[w];
+    }
+    ordered.resize(segment.size());
+    slot.assign(waveStart.begin(), waveStart.end() - 1);
+    for (size_t s = 0; s < segment.size(); ++s) {
+      ordered[slot[wave[s]]++] = segment[s];
+    }
+    for (int w = 0; w < waves; ++w) {
+      int begin = waveStart[w], end = waveStart[w + 1];
+#ifdef ICG_NARROWPHASE_AVX2
+      if (avx2) {
+        for (; begin + kLanes <= end; begin += kLanes) {
+          impulseAVX2(&ordered[begin]);
+        }
+      }
+#endif
+      for (; begin < end; ++begin) {
+        impulseScalar(ordered[begin]);
+      }
+    }
+  }
+
+  // Object::isQuiet on the current velocities
+  bool isQuiet(int i, const Object &object, double sleepVelocity) const {
+    const auto &b = bodies[i];
+    vec3 av = touched[i] ? vec3{b.vx, b.vy, b.vz} : object.av;
+    for (int k = 0; k < 3; ++k) {
+      if (abs(av[k]) >= sleepVelocity) {
+        return false;
+      }
+    }
+    return b.vx * b.vx + b.vy * b.vy + b.vz * b.vz <
+           sleepVelocity * sleepVelocity;
+  }
+
+  // one pair, the same arithmetic as the AVX2 kernel
+  void impulseScalar(int p) {
+    int i = (*pairs)[p].first, j = (*pairs)[p].second;
+    auto &a = bodies[i], &b = bodies[j];
+    double m = a.mass + b.mass;
+    double *vi[3] = {&a.vx, &a.vy, &a.vz}, *vj[3] = {&b.vx, &b.vy, &b.vz};
+    for (int k = 0; k < 3; ++k) {
+      double moSum = a.mass * *vi[k] + b.mass * *vj[k];
+      double ni = (moSum + cofRes[i] * b.mass * (*vj[k] - *vi[k])) / m;
+      double nj = (moSum + cofRes[j] * a.mass * (*vi[k] - *vj[k])) / m;
+      *vi[k] = ni;
+      *vj[k] = nj;
+    }
+    touched[i] = touched[j] = 1;
+  }
+
+  // a quiet body against a sleeper, which stays put as if it were static:
+  // the body is moved out of it and the velocity toward it bounces
+  void resolveStatic(int p, int sleeper) {
+    int i = (*pairs)[p].first == sleeper ? (*pairs)[p].second
+                                         : (*pairs)[p].first;
+    auto &a = spheres[i];
+    const auto &s = spheres[sleeper];
+    double center[3] = {s.x, s.y, s.z};
+    double n[3] = {a.x - s.x, a.y - s.y, a.z - s.z};
+    double dis = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    if (dis < Object::eps) {
+      return;
+    }
+    auto &b = bodies[i];
+    double *pos[3] = {&a.x, &a.y, &a.z}, *v[3] = {&b.vx, &b.vy, &b.vz};
+    double vn = 0;
+    for (int k = 0; k < 3; ++k) {
+      n[k] /= dis;
+      *pos[k] = center[k] + n[k] * (a.radius + s.radius);
+      vn += *v[k] * n[k];
+    }
+    if (vn < 0) {
+      for (int k = 0; k < 3; ++k) {
+        *v[k] -= (1 + cofRes[i]) * vn * n[k];
+      }
+    }
+    touched[i] = moved[i] = 1;
+  }
+
+private:
+  bool avx2{false};
+  const vector<pair<int, int>> *pairs{nullptr};
+  vector<uint8_t> touched, moved;
+  vector<int> wave, lastWave, waveStart, slot, ordered;
+
+  void testScalar(int p) {
+    const auto &a = spheres[(*pairs)[p].first];
+    const auto &b = spheres[(*pairs)[p].second];
+    double dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z;
+    double d2 = dx * dx + dy * dy + dz * dz;
+    double r = a.radius + b.radius;
+    double hit = max(r - 1e-3, 0.0), near = r + 1e-1;
+    if (d2 <= near * near) {
+      hits.emplace_back(p);
+      hitFlags.emplace_back((d2 <= hit * hit ? kOverlap : 0) | kContact);
+    }
+  }
+
+#ifdef ICG_NARROWPHASE_AVX2
+  // rows of four doubles become columns
+  __attribute__((target("avx2"))) static void
+  transpose(__m256d &r0, __m256d &r1, __m256d &r2, __m256d &r3) {
+    __m256d t0 = _mm256_unpacklo_pd(r0, r1), t1 = _mm256_unpackhi_pd(r0, r1);
+    __m256d t2 = _mm256_unpacklo_pd(r2, r3), t3 = _mm256_unpackhi_pd(r2, r3);
+    r0 = _mm256_permute2f128_pd(t0, t2, 0x20);
+    r1 = _mm256_permute2f128_pd(t1, t3, 0x20);
+    r2 = _mm256_permute2f128_pd(t0, t2, 0x31);
+    r3 = _mm256_permute2f128_pd(t1, t3, 0x31);
+  }
+
+  // the four members of four records, one register per member
+  template <class Record>
+  __attribute__((target("avx2"))) static void
+  gather(const Record *records, const int *ids, __m256d &x, __m256d &y,
+         __m256d &z, __m256d &w) {
+    x = _mm256_loadu_pd((const double *)&records[ids[0]]);
+    y = _mm256_loadu_pd((const double *)&records[ids[1]]);
+    z = _mm256_loadu_pd((const double *)&records[ids[2]]);
+    w = _mm256_loadu_pd((const double *)&records[ids[3]]);
+    transpose(x, y, z, w);
+  }
+
+  __attribute__((target("avx2"))) void testAVX2(int p) {
+    const auto *ps = &(*pairs)[p];
+    for (int half = 0; half < kLanes; half += 4) {
+      int i[4], j[4];
+      for (int l = 0; l < 4; ++l) {
+        i[l] = ps[half + l].first;
+        j[l] = ps[half + l].second;
+      }
+      __m256d xi, yi, zi, ri, xj, yj, zj, rj;
+      gather(spheres.data(), i, xi, yi, zi, ri);
+      gather(spheres.data(), j, xj, yj, zj, rj);
+      __m256d dx = _mm256_sub_pd(xi, xj), dy = _mm256_sub_pd(yi, yj),
+              dz = _mm256_sub_pd(zi, zj);
+      __m256d d2 = _mm256_add_pd(
+          _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)),
+          _mm256_mul_pd(dz, dz));
+      __m256d r = _mm256_add_pd(ri, rj);
+      __m256d hit = _mm256_max_pd(_mm256_sub_pd(r, _mm256_set1_pd(1e-3)),
+                                  _mm256_setzero_pd());
+      __m256d near = _mm256_add_pd(r, _mm256_set1_pd(1e-1));
+      int overlap = _mm256_movemask_pd(
+          _mm256_cmp_pd(d2, _mm256_mul_pd(hit, hit), _CMP_LE_OQ));
+      int contact = _mm256_movemask_pd(
+          _mm256_cmp_pd(d2, _mm256_mul_pd(near, near), _CMP_LE_OQ));
+      for (; contact; contact &= contact - 1) {
+        int l = __builtin_ctz(contact);
+        hits.emplace_back(p + half + l);
+        hitFlags.emplace_back((overlap >> l & 1 ? kOverlap : 0) | kContact);
+      }
+    }
+  }
+
+  // kLanes pairs that share no body
+  __attribute__((target("avx2"))) void impulseAVX2(const int *lanes) {
+    for (int half = 0; half < kLanes; half += 4) {
+      int i[4], j[4];
+      for (int l = 0; l < 4; ++l) {
+        i[l] = (*pairs)[lanes[half + l]].first;
+        j[l] = (*pairs)[lanes[half + l]].second;
+        touched[i[l]] = touched[j[l]] = 1;
+      }
+      __m256d vi[3], vj[3], mi, mj;
+      gather(bodies.data(), i, vi[0], vi[1], vi[2], mi);
+      gather(bodies.data(), j, vj[0], vj[1], vj[2], mj);
+      __m256d ei = _mm256_setr_pd(cofRes[i[0]], cofRes[i[1]], cofRes[i[2]],
+                                  cofRes[i[3]]);
+      __m256d ej = _mm256_setr_pd(cofRes[j[0]], cofRes[j[1]], cofRes[j[2]],
+                                  cofRes[j[3]]);
+      __m256d m = _mm256_add_pd(mi, mj);
+      __m256d wi = _mm256_mul_pd(ei, mj), wj = _mm256_mul_pd(ej, mi);
+      for (int k = 0; k < 3; ++k) {
+        __m256d moSum = _mm256_add_pd(_mm256_mul_pd(mi, vi[k]),
+                                      _mm256_mul_pd(mj, vj[k]));
+        __m256d ni = _mm256_div_pd(
+            _mm256_add_pd(moSum,
+                          _mm256_mul_pd(wi, _mm256_sub_pd(vj[k], vi[k]))),
+            m);
+        __m256d nj = _mm256_div_pd(
+            _mm256_add_pd(moSum,
+                          _mm256_mul_pd(wj, _mm256_sub_pd(vi[k], vj[k]))),
+            m);
+        vi[k] = ni;
+        vj[k] = nj;
+      }
+      // AVX2 has no scatter, transpose back and store whole records
+      transpose(vi[0], vi[1], vi[2], mi);
+      transpose(vj[0], vj[1], vj[2], mj);
+      __m256d outI[4] = {vi[0], vi[1], vi[2], mi};
+      __m256d outJ[4] = {vj[0], vj[1], vj[2], mj};
+      for (int l = 0; l < 4; ++l) {
+        _mm256_storeu_pd((double *)&bodies[i[l]], outI[l]);
+        _mm256_storeu_pd((double *)&bodies[j[l]], outJ[l]);
+      }
+    }
+  }
+#endif
+};
+
+} // namespace ICG
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+namespace ICG {
+
+// Bridson's Poisson-disk sampling of a box: points no closer than spacing
+// to each other, spread without the gaps and clumps of uniform ones.
+// Sampling grows breadth first from start, so a limited sample is a compact
+// ball around it. The oldest active point tries kAttempts candidates and
+// retires once they all fail. Candidates sit on the sphere of radius
+// spacing around it, as Roberts suggests, along one of kDirections
+// directions spread evenly over the sphere. That packs denser than
+// Bridson's shell and takes no trigonometry. The grid cells are
+// spacing/sqrt(3) wide, so a cell holds at most one point. A candidate
+// looks only at the cells that can reach within spacing, closest first,
+// so most rejections stop after a few loads. The random numbers come from
+// uniform, a callable giving doubles in [0, 1) with 48 random bits or more,
+// so the caller decides how the draws are keyed.
+class PoissonDisk {
+public:
+  typedef array<double, 3> point;
+  static const int kAttempts = 8;
+  // 12 bits of a draw pick a direction, so one draw picks four
+  static const int kDirections = 4096;
+
+  // at most limit points of [lo, hi] grown from start, which is the first
+  // one, empty if start is outside or the grid would not fit in memory
+  template <typename Uniform>
+  static vector<point> sample(const point &lo, const point &hi,
+                              double spacing, const point &start,
+                              size_t limit, Uniform &&uniform) {
+    vector<point> points;
+    double inverse = sqrt(3.0) / spacing;
+    int n[3];
+    int64_t count = 1;
+    for (int k = 0; k < 3; ++k) {
+      if (!(start[k] >= lo[k] && start[k] <= hi[k])) {
+        return points;
+      }
+      // two empty cells on either side keep the cells near a candidate in
+      // the grid
+      n[k] = (int)((hi[k] - lo[k]) * inverse) + 5;
+      count *= n[k];
+    }
+    if (limit == 0 || count > kMaxCells) {
+      return points;
+    }
+    // the point in every cell, -1 if none
+    vector<int> grid(count, -1);
+    auto cellOf = [&](const point &p) {
+      int64_t at = 0;
+      for (int k = 2; k >= 0; --k) {
+        at = at * n[k] + (int)((p[k] - lo[k]) * inverse) + 2;
+      }
+      return at;
+    };
+    vector<int64_t> around;
+    for (const auto &o : offsets()) {
+      around.emplace_back(((int64_t)o[2] * n[1] + o[1]) * n[0] + o[0]);
+    }
+    double limit2 = spacing * spacing;
+    auto fits = [&](const point &p) {
+      int64_t at = cellOf(p);
+      for (int64_t o : around) {
+        int other = grid[at + o];
+        if (other < 0) {
+          continue;
+        }
+        const auto &q = points[other];
+        double d2 = (p[0] - q[0]) * (p[0] - q[0]) +
+                    (p[1] - q[1]) * (p[1] - q[1]) +
+                    (p[2] - q[2]) * (p[2] - q[2]);
+        if (d2 < limit2) {
+          return false;
+        }
+      }
+      return true;
+    };
+    auto add = [&](const point &p) {
+      grid[cellOf(p)] = points.size();
+      points.emplace_back(p);
+    };
+    add(start);
+    const auto &toward = directions();
+    // a hair over spacing so rounding does not reject the parent's own
+    // neighbors on the sphere
+    double reach = spacing * (1 + 1e-9);
+    double draw = 0;
+    int left = 0;
+    for (size_t active = 0; active < points.size() && points.size() < limit;) {
+      const point from = points[active];
+      bool placed = false;
+      for (int attempt = 0; attempt < kAttempts && !placed; ++attempt) {
+        if (left == 0) {
+          draw = uniform();
+          left = 4;
+        }
+        draw *= kDirections;
+        int pick = min((int)draw, kDirections - 1);
+        draw -= pick;
+        left--;
+        const auto &d = toward[pick];
+        point p{from[0] + reach * d[0], from[1] + reach * d[1],
+                from[2] + reach * d[2]};
+        if (p[0] < lo[0] || p[1] < lo[1] || p[2] < lo[2] || p[0] > hi[0] ||
+            p[1] > hi[1] || p[2] > hi[2] || !fits(p)) {
+          continue;
+        }
+        add(p);
+        placed = true;
+      }
+      if (!placed) {
+        active++;
+      }
+    }
+    return points;
+  }
+
+private:
+  static const int64_t kMaxCells = 1 << 28;
+
+  // a Fibonacci lattice on the unit sphere
+  static const vector<point> &directions() {
+    static const vector<point> toward = [] {
+      vector<point> d(kDirections);
+      double turn = M_PI * (3 - sqrt(5.0));
+      for (int i = 0; i < kDirections; ++i) {
+        double z = 1 - (2 * i + 1.0) / kDirections, r = sqrt(1 - z * z);
+        d[i] = {r * cos(i * turn), r * sin(i * turn), z};
+      }
+      return d;
+    }();
+    return toward;
+  }
+
+  // cells within two of a cell that can hold a point closer than spacing,
+  // nearest first; the eight corners are always too far
+  static const vector<array<int, 3>> &offsets() {
+    static const vector<array<int, 3>> around = [] {
+      vector<array<int, 3>> cells;
+      for (int z = -2; z <= 2; ++z) {
+        for (int y = -2; y <= 2; ++y) {
+          for (int x = -2; x <= 2; ++x) {
+            if (abs(x) + abs(y) + abs(z) < 6) {
+              cells.push_back({{x, y, z}});
+            }
+          }
+        }
+      }
+      stable_sort(cells.begin(), cells.end(),
+                  [](const array<int, 3> &a, const array<int, 3> &b) {
+                    return a[0] * a[0] + a[1] * a[1] + a[2] * a[2] <
+                           b[0] * b[0] + b[1] * b[1] + b[2] * b[2];
+                  });
+      return cells;
+    }();
+    return around;
+  }
+};
+
+} // namespace ICG
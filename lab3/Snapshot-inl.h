@@ -0,0 +1,307 @@
+#pragma once
+
+#include "Cloth-inl.h"
+#include "Emitter-inl.h"
+#include "EventEngine-inl.h"
+#include "Fluid-inl.h"
+#include "SystemDS.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <glog/logging.h>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+namespace ICG {
+
+// Binary snapshot of everything that changes while a FrameSystem steps.
+// Models, scene constants and the broadphase come from the .des file, so a
+// snapshot is restored into a system loaded from the same scene and then
+// continues bit-identically.
+class Snapshot {
+public:
+  static void save(const FrameSystem &fs, string &buffer) {
+    buffer.clear();
+    put(buffer, kMagic);
+    put(buffer, kVersion);
+    put(buffer, fs.frameCounter);
+    put(buffer, (int32_t)fs.objects.size());
+    for (const auto &object : fs.objects) {
+      put(buffer, object->pos);
+      put(buffer, object->v);
+      put(buffer, object->av);
+      put(buffer, object->rotation);
+      put(buffer, (int32_t)object->sleeping);
+      put(buffer, object->quietTime);
+      put(buffer, object->island);
+      put(buffer, object->stepSize);
+    }
+    const auto &engine = fs.eventEngine;
+    put(buffer, (int32_t)(engine != nullptr));
+    if (engine) {
+      put(buffer, engine->time);
+      for (const auto &ball : engine->balls) {
+        put(buffer, ball.t0);
+        put(buffer, ball.p0);
+        put(buffer, ball.v0);
+        put(buffer, (int32_t)ball.resting);
+        put(buffer, ball.count);
+      }
+    }
+    put(buffer, (int32_t)fs.emitters.size());
+    for (const auto &emitter : fs.emitters) {
+      put(buffer, emitter->pending);
+      ostringstream rngState;
+      rngState << emitter->rng;
+      put(buffer, (int32_t)rngState.str().size());
+      buffer.append(rngState.str());
+      auto &pool = emitter->pool;
+      put(buffer, pool.count);
+      for (auto array : {&pool.x, &pool.y, &pool.z, &pool.vx, &pool.vy,
+                         &pool.vz, &pool.age, &pool.life}) {
+        buffer.append(reinterpret_cast<const char *>(array->data()),
+                      pool.count * sizeof(float));
+      }
+    }
+    const auto &fluid = fs.fluid;
+    put(buffer, (int32_t)(fluid ? fluid->count : -1));
+    if (fluid) {
+      for (auto array : {&fluid->x, &fluid->y, &fluid->z, &fluid->vx,
+                         &fluid->vy, &fluid->vz}) {
+        buffer.append(reinterpret_cast<const char *>(array->data()),
+                      fluid->count * sizeof(float));
+      }
+    }
+    put(buffer, (int32_t)fs.cloths.size());
+    for (const auto &cloth : fs.cloths) {
+      put(buffer, cloth->count);
+      for (auto array : {&cloth->x, &cloth->y, &cloth->z, &cloth->px,
+                         &cloth->py, &cloth->pz}) {
+        buffer.append(reinterpret_cast<const char *>(array->data()),
+                      cloth->count * sizeof(float));
+      }
+    }
+  }
+
+  static bool restore(const string &buffer, FrameSystem &fs) {
+    size_t at = 0;
+    int32_t magic, version, count, flag;
+    if (!get(buffer, at, magic) || magic != kMagic ||
+        !get(buffer, at, version) || version != kVersion) {
+      LOG(ERROR) << "Not a snapshot of this version";
+      return false;
+    }
+    // the counter is only taken once the whole snapshot checks out
+    int frameCounter = 0;
+    get(buffer, at, frameCounter);
+    get(buffer, at, count);
+    if (count != (int32_t)fs.objects.size()) {
+      LOG(ERROR) << "Snapshot has " << count << " objects, scene has "
+                 << fs.objects.size();
+      return false;
+    }
+    for (const auto &object : fs.objects) {
+      get(buffer, at, object->pos);
+      get(buffer, at, object->v);
+      get(buffer, at, object->av);
+      get(buffer, at, object->rotation);
+      get(buffer, at, flag);
+      object->sleeping = flag;
+      get(buffer, at, object->quietTime);
+      get(buffer, at, object->island);
+      get(buffer, at, object->stepSize);
+      object->calFrame();
+    }
+    fs.broadphase = SpatialHash();
+    fs.eventEngine = nullptr;
+    get(buffer, at, flag);
+    if (flag) {
+      auto engine = make_shared<EventEngine>();
+      get(buffer, at, engine->time);
+      engine->balls.resize(count);
+      for (auto &ball : engine->balls) {
+        get(buffer, at, ball.t0);
+        get(buffer, at, ball.p0);
+        get(buffer, at, ball.v0);
+        get(buffer, at, flag);
+        ball.resting = flag;
+        get(buffer, at, ball.count);
+      }
+      // predictions only depend on the trajectories, rebuilding the queue
+      // gives back the pending events
+      engine->rebuild(fs);
+      fs.eventEngine = engine;
+    }
+    get(buffer, at, count);
+    if (count != (int32_t)fs.emitters.size()) {
+      LOG(ERROR) << "Snapshot has " << count << " emitters, scene has "
+                 << fs.emitters.size();
+      return false;
+    }
+    for (const auto &emitter : fs.emitters) {
+      int32_t length;
+      get(buffer, at, emitter->pending);
+      get(buffer, at, length);
+      if (length < 0 || at + length > buffer.size()) {
+        break;
+      }
+      istringstream rngState(buffer.substr(at, length));
+      rngState >> emitter->rng;
+      at += length;
+      auto &pool = emitter->pool;
+      get(buffer, at, pool.count);
+      size_t bytes = pool.count * sizeof(float);
+      if (pool.count < 0 || pool.count > pool.capacity ||
+          at + bytes * 8 > buffer.size()) {
+        break;
+      }
+      for (auto array : {&pool.x, &pool.y, &pool.z, &pool.vx, &pool.vy,
+                         &pool.vz, &pool.age, &pool.life}) {
+        memcpy(array->data(), buffer.data() + at, bytes);
+        at += bytes;
+      }
+      pool.fillVertices();
+    }
+    get(buffer, at, count);
+    if (count != (fs.fluid ? fs.fluid->count : -1)) {
+      LOG(ERROR) << "Snapshot fluid does not match the scene";
+      return false;
+    }
+    if (fs.fluid) {
+      auto &fluid = *fs.fluid;
+      size_t bytes = fluid.count * sizeof(float);
+      for (auto array :
+           {&fluid.x, &fluid.y, &fluid.z, &fluid.vx, &fluid.vy, &fluid.vz}) {
+        if (at + bytes > buffer.size()) {
+          at = buffer.size() + 1;
+          break;
+        }
+        memcpy(array->data(), buffer.data() + at, bytes);
+        at += bytes;
+      }
+      fluid.fillVertices();
+    }
+    get(buffer, at, count);
+    if (count != (int32_t)fs.cloths.size()) {
+      LOG(ERROR) << "Snapshot has " << count << " cloths, scene has "
+                 << fs.cloths.size();
+      return false;
+    }
+    for (const auto &cloth : fs.cloths) {
+      get(buffer, at, count);
+      size_t bytes = cloth->count * sizeof(float);
+      if (count != cloth->count || at + bytes * 6 > buffer.size()) {
+        LOG(ERROR) << "Snapshot cloth does not match the scene";
+        return false;
+      }
+      for (auto array : {&cloth->x, &cloth->y, &cloth->z, &cloth->px,
+                         &cloth->py, &cloth->pz}) {
+        memcpy(array->data(), buffer.data() + at, bytes);
+        at += bytes;
+      }
+      cloth->fillVertices();
+    }
+    if (at != buffer.size()) {
+      LOG(ERROR) << "Snapshot is truncated or corrupted";
+      return false;
+    }
+    fs.frameCounter = frameCounter;
+    return true;
+  }
+
+  static bool loadFile(const string &fileName, FrameSystem &fs) {
+    ifstream file(fileName, ios::in | ios::binary);
+    if (not file.is_open()) {
+      LOG(ERROR) << "Cannot open snapshot file: " << fileName;
+      return false;
+    }
+    string buffer((istreambuf_iterator<char>(file)),
+                  istreambuf_iterator<char>());
+    return restore(buffer, fs);
+  }
+
+private:
+  static const int32_t kMagic = 0x53474349; // "ICGS"
+  static const int32_t kVersion = 4;
+
+  template <typename T> static void put(string &buffer, T value) {
+    buffer.append(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+
+  template <typename T>
+  static bool get(const string &buffer, size_t &at, T &value) {
+    if (at + sizeof(T) > buffer.size()) {
+      at = buffer.size() + 1;
+      return false;
+    }
+    memcpy(&value, buffer.data() + at, sizeof(T));
+    at += sizeof(T);
+    return true;
+  }
+};
+
+// Writes snapshots from a background thread so the step loop only pays for
+// serializing into memory. At most maxPending snapshots wait for the disk,
+// newer ones are dropped rather than stalling the simulation.
+class SnapshotWriter {
+public:
+  size_t maxPending{4};
+
+  SnapshotWriter() : worker([this] { run(); }) {}
+
+  ~SnapshotWriter() {
+    {
+      lock_guard<mutex> lock(mtx);
+      done = true;
+    }
+    cv.notify_one();
+    worker.join();
+  }
+
+  void write(const string &fileName, string &&buffer) {
+    {
+      lock_guard<mutex> lock(mtx);
+      if (pending.size() >= maxPending) {
+        LOG(WARNING) << "Snapshot writer is behind, dropping " << fileName;
+        return;
+      }
+      pending.emplace_back(fileName, move(buffer));
+    }
+    cv.notify_one();
+  }
+
+private:
+  mutex mtx;
+  condition_variable cv;
+  deque<pair<string, string>> pending;
+  bool done{false};
+  thread worker;
+
+  void run() {
+    unique_lock<mutex> lock(mtx);
+    while (true) {
+      cv.wait(lock, [this] { return done || !pending.empty(); });
+      if (pending.empty()) {
+        return;
+      }
+      auto job = move(pending.front());
+      pending.pop_front();
+      lock.unlock();
+      ofstream file(job.first, ios::out | ios::binary | ios::trunc);
+      file.write(job.second.data(), job.second.size());
+      if (!file) {
+        LOG(ERROR) << "Cannot write snapshot file: " << job.first;
+      }
+      lock.lock();
+    }
+  }
+};
+
+} // namespace ICG
@@ -1,16 +1,40 @@
 #include "SystemDS.h"
+#include "BVH-inl.h"
+#include "Cloth-inl.h"
+#include "Emitter-inl.h"
+#include "EventEngine-inl.h"
+#include "Fluid-inl.h"
 #include "Loader-inl.h"
 #include "MatrixOp-inl.h"
+#include "Narrowphase-inl.h"
+#include "Query-inl.h"
+#include "Snapshot-inl.h"
+#include "Trajectory-inl.h"
+#include "WorldBatch-inl.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <glog/logging.h>
 #include <iostream>
+#include <numeric>
 
 using namespace std;
 
 namespace ICG {
 const double Object::g = 9.8;
 const double Object::eps = 1e-3;
+bool Object::isQuiet(double sleepVelocity) const {
+  double speed = 0;
+  for (int i = 0; i < 3; ++i) {
+    if (abs(av[i]) >= sleepVelocity) {
+      return false;
+    }
+    speed += v[i] * v[i];
+  }
+  return speed < sleepVelocity * sleepVelocity;
+}
+
 void Object::calFrame() {
   vector<double> initVec{pos[0],      pos[1],      pos[2],
                          rotation[0], rotation[1], rotation[2]};
@@ -35,27 +59,31 @@ void Object::boxCheck(double boxSize) {
   }
 }
 
-void Object::calPos(const double &deltaT, double boxSize) {
+vec3 Object::calVel(const double &deltaT, double boxSize) const {
   bool hitGround = abs(pos[1] - radius + boxSize) < eps;
   bool touchGround = abs(pos[1] - radius + boxSize) < 1e-1;
+  vec3 newV = v;
   for (int i = 0; i < 3; ++i) {
-    double newV = v[i];
     if (i == 1) {
       if (!hitGround) {
-        newV = v[1] - g * deltaT;
+        newV[1] = v[1] - g * deltaT;
       }
     }
     if (touchGround && i != 1) {
       double vprime = abs(v[i]) - g * friction * deltaT;
       if (vprime > 0) {
-        newV = (v[i] / abs(v[i])) * vprime;
+        newV[i] = (v[i] / abs(v[i])) * vprime;
       } else {
-        newV = 0;
+        newV[i] = 0;
       }
     }
-    pos[i] += (newV + v[i]) / 2 * deltaT;
-    v[i] = newV;
+  }
+  return newV;
+}
 
+void Object::spin(double boxSize) {
+  bool touchGround = abs(pos[1] - radius + boxSize) < 1e-1;
+  for (int i = 0; i < 3; ++i) {
     rotation[i] += av[i];
     while (rotation[i] >= 360) rotation[i] -= 360;
     while (rotation[i] < 0) rotation[i] += 360;
@@ -66,44 +94,341 @@ void Object::calPos(const double &deltaT, double boxSize) {
       }
     }
   }
+}
+
+void Object::calPos(const double &deltaT, double boxSize,
+                    const Integrator &integrator) {
+  switch (integrator.type) {
+  case INTEGRATOR_TRAPEZOID: {
+    vec3 newV = calVel(deltaT, boxSize);
+    for (int i = 0; i < 3; ++i) {
+      pos[i] += (newV[i] + v[i]) / 2 * deltaT;
+    }
+    v = newV;
+    break;
+  }
+  case INTEGRATOR_EULER: {
+    v = calVel(deltaT, boxSize);
+    for (int i = 0; i < 3; ++i) {
+      pos[i] += v[i] * deltaT;
+    }
+    break;
+  }
+  case INTEGRATOR_VERLET: {
+    // kick, drift, kick with the second kick taken at the new position
+    v = calVel(deltaT / 2, boxSize);
+    for (int i = 0; i < 3; ++i) {
+      pos[i] += v[i] * deltaT;
+    }
+    v = calVel(deltaT / 2, boxSize);
+    break;
+  }
+  case INTEGRATOR_ADAPTIVE: {
+    // Verlet steps sized so that the change of acceleration over a step,
+    // which Verlet does not see, moves the body less than the tolerance
+    double minStep = deltaT / integrator.maxSubsteps;
+    if (stepSize <= 0) {
+      stepSize = deltaT;
+    }
+    double t = 0;
+    while (t < deltaT) {
+      // the last step of a frame is cut to what is left of it
+      bool cut = stepSize > deltaT - t;
+      double step = cut ? deltaT - t : stepSize;
+      vec3 oldPos = pos, oldV = v;
+      vec3 halfV = calVel(step / 2, boxSize);
+      for (int i = 0; i < 3; ++i) {
+        pos[i] += halfV[i] * step;
+      }
+      v = halfV;
+      v = calVel(step / 2, boxSize);
+      double error = 0;
+      for (int i = 0; i < 3; ++i) {
+        error = max(error, abs(v[i] - 2 * halfV[i] + oldV[i]) * step);
+      }
+      if (error > integrator.tolerance && step > minStep) {
+        pos = oldPos;
+        v = oldV;
+        stepSize = max(step / 2, minStep);
+        continue;
+      }
+      t += step;
+      // a cut step says little about the next one, which keeps the size
+      // proposed before it
+      if (!cut) {
+        double grow = 0.9 * sqrt(integrator.tolerance / max(error, 1e-12));
+        stepSize = max(minStep, step * min(2.0, grow));
+      }
+    }
+    break;
+  }
+  }
   boxCheck(boxSize);
 };
 
-static double distance(shared_ptr<Object> a, shared_ptr<Object> b) {
-  double sum = 0;
-  for (int i = 0; i < 3; ++i) {
-    sum += (a->pos[i] - b->pos[i]) * (a->pos[i] - b->pos[i]);
+void FrameSystem::step() {
+  frameCounter++;
+  for (const auto &emitter : emitters) {
+    emitter->update(deltaT, boxSize);
+  }
+  if (fluid) {
+    // the event engine owns the ball trajectories, balls only push there
+    fluid->update(deltaT, *this, *threadPool, engine == ENGINE_STEP);
+  }
+  for (const auto &cloth : cloths) {
+    cloth->update(deltaT, *this, *threadPool);
+  }
+  if (engine == ENGINE_EVENT) {
+    if (!eventEngine) {
+      eventEngine = make_shared<EventEngine>();
+      eventEngine->init(*this);
+    } else {
+      eventEngine->resync(*this);
+    }
+    eventEngine->advance(*this, deltaT);
+    return;
+  }
+  for (const auto &object : objects) {
+    if (!object->sleeping) {
+      object->spin(boxSize);
+    }
+  }
+  int substeps = calSubsteps();
+  for (int s = 0; s < substeps; ++s) {
+    for (const auto &object : objects) {
+      if (!object->sleeping) {
+        object->calPos(deltaT / substeps, boxSize, integrator);
+      }
+    }
+    collisionCheck();
+    meshCheck();
   }
-  return sqrt(sum);
+  for (const auto &object : objects) {
+    if (!object->sleeping) {
+      object->calFrame();
+    }
+  }
+  updateSleeping();
 }
-void FrameSystem::collisionCheck() {
+
+int FrameSystem::calSubsteps() const {
+  // enough substeps that no body moves more than maxMove of its radius
+  double ratio = 0;
+  for (const auto &object : objects) {
+    if (object->sleeping) {
+      continue;
+    }
+    double speed = sqrt(object->v[0] * object->v[0] +
+                        object->v[1] * object->v[1] +
+                        object->v[2] * object->v[2]);
+    ratio = max(ratio, speed * deltaT / (integrator.maxMove * object->radius));
+  }
+  return max(1, min(integrator.maxSubsteps, (int)ceil(ratio)));
+}
+
+void FrameSystem::indexBroadphase() {
   int cnt = objects.size();
+  bool rebuild = broadphase.size() != cnt;
+  if (rebuild) {
+    double maxRadius = Object::eps;
+    for (const auto &object : objects) {
+      maxRadius = max(maxRadius, object->radius);
+    }
+    broadphase.reset(2 * maxRadius, cnt);
+  }
   for (int i = 0; i < cnt; ++i) {
-    for (int j = i + 1; j < cnt; ++j) {
-      if (distance(objects[i], objects[j]) + 1e-3 <=
-          (objects[i]->radius + objects[j]->radius)) {
-        LOG(ERROR) << distance(objects[i], objects[j]);
-        for (int k = 0; k < 3; ++k) {
-          double moSum = objects[i]->mass * objects[i]->v[k] +
-                         objects[j]->mass * objects[j]->v[k];
-          double vi = (moSum + objects[i]->cofRes * objects[j]->mass *
-                                   (objects[j]->v[k] - objects[i]->v[k])) /
-                      (objects[i]->mass + objects[j]->mass);
-          double vj = (moSum + objects[j]->cofRes * objects[i]->mass *
-                                   (objects[i]->v[k] - objects[j]->v[k])) /
-                      (objects[i]->mass + objects[j]->mass);
-          LOG(ERROR) << objects[i]->v[k] << " " << objects[j]->v[k];
-          LOG(ERROR) << vi << " " << vj;
-          objects[i]->v[k] = vi;
-          objects[j]->v[k] = vj;
+    if (rebuild || !objects[i]->sleeping) {
+      broadphase.update(i, objects[i]->pos);
+    }
+  }
+}
 
-          objects[i]->av[k] = vi;
-          objects[j]->av[k] = vj;
-        }
+WorldQuery FrameSystem::query() {
+  if (queryFrame != frameCounter || broadphase.size() != (int)objects.size()) {
+    indexBroadphase();
+    queryLo = {HUGE_VAL, HUGE_VAL, HUGE_VAL};
+    queryHi = {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+    for (const auto &object : objects) {
+      for (int k = 0; k < 3; ++k) {
+        queryLo[k] = min(queryLo[k], object->pos[k]);
+        queryHi[k] = max(queryHi[k], object->pos[k]);
       }
     }
+    queryFrame = frameCounter;
+  }
+  return WorldQuery(broadphase, objects, queryLo, queryHi);
+}
+
+void FrameSystem::updateBroadphase() {
+  indexBroadphase();
+  int cnt = objects.size();
+
+  // only awake bodies look for partners, an awake pair is reported by the
+  // smaller index so that every pair shows up once
+  double maxRadius = broadphase.cellSize / 2;
+  pairs.clear();
+  for (int i = 0; i < cnt; ++i) {
+    if (objects[i]->sleeping) {
+      continue;
+    }
+    vec3 lo, hi;
+    for (int k = 0; k < 3; ++k) {
+      lo[k] = objects[i]->pos[k] - objects[i]->radius - maxRadius;
+      hi[k] = objects[i]->pos[k] + objects[i]->radius + maxRadius;
+    }
+    broadphase.query(lo, hi, [&](int j) {
+      if (j == i || (j < i && !objects[j]->sleeping)) {
+        return;
+      }
+      pairs.emplace_back(min(i, j), max(i, j));
+    });
+  }
+  // keep the resolve order independent of the bucket layout
+  sort(pairs.begin(), pairs.end());
+}
+
+void FrameSystem::collisionCheck() {
+  updateBroadphase();
+  contacts.clear();
+  if (!narrowphase) {
+    narrowphase = make_shared<Narrowphase>();
+  }
+  auto &np = *narrowphase;
+  np.load(objects);
+  np.test(pairs);
+  // awake pairs are resolved in batches, a pair with a sleeper waits for
+  // the pairs before it since waking depends on their velocities
+  segment.clear();
+  for (size_t h = 0; h < np.hits.size(); ++h) {
+    int p = np.hits[h], i = pairs[p].first, j = pairs[p].second;
+    bool overlap = np.hitFlags[h] & Narrowphase::kOverlap;
+    if (overlap && !np.asleep[i] && !np.asleep[j]) {
+      segment.emplace_back(p);
+    } else if (overlap) {
+      np.resolve(segment);
+      segment.clear();
+      // a sleeping body is only woken by something that is still moving,
+      // anything slower rests on it
+      int sleeper = np.asleep[i] ? i : j;
+      int other = sleeper == i ? j : i;
+      if (np.isQuiet(other, *objects[other], sleepVelocity)) {
+        np.resolveStatic(p, sleeper);
+        continue;
+      }
+      wake(sleeper);
+      np.loadSleeping(objects);
+      np.impulseScalar(p);
+    }
+    // bodies resting against each other form one island
+    if (!np.asleep[i] && !np.asleep[j]) {
+      contacts.emplace_back(pairs[p]);
+    }
+  }
+  np.resolve(segment);
+  np.store(objects);
+}
+
+void FrameSystem::meshCheck() {
+  for (const auto &object : objects) {
+    if (object->sleeping) {
+      continue;
+    }
+    for (const auto &mesh : meshes) {
+      vec3 q, n;
+      if (!mesh->bvh.closestPoint(object->pos, object->radius, q)) {
+        continue;
+      }
+      double dis = 0;
+      for (int k = 0; k < 3; ++k) {
+        n[k] = object->pos[k] - q[k];
+        dis += n[k] * n[k];
+      }
+      dis = sqrt(dis);
+      if (dis < Object::eps) {
+        continue;
+      }
+      // rest on the surface, bounce the normal velocity and let friction
+      // take tangential velocity in proportion to the normal impulse
+      double vn = 0;
+      for (int k = 0; k < 3; ++k) {
+        n[k] /= dis;
+        object->pos[k] = q[k] + n[k] * object->radius;
+        vn += object->v[k] * n[k];
+      }
+      if (vn >= 0) {
+        continue;
+      }
+      double dv = -(1 + object->cofRes) * vn;
+      vec3 vt;
+      double vtLen = 0;
+      for (int k = 0; k < 3; ++k) {
+        vt[k] = object->v[k] - vn * n[k];
+        vtLen += vt[k] * vt[k];
+      }
+      vtLen = sqrt(vtLen);
+      double keep =
+          vtLen > 0 ? max(0.0, vtLen - object->friction * dv) / vtLen : 0;
+      for (int k = 0; k < 3; ++k) {
+        object->v[k] = vt[k] * keep - object->cofRes * vn * n[k];
+      }
+    }
+  }
+}
+
+void FrameSystem::updateSleeping() {
+  if (sleepTime <= 0) {
+    return;
+  }
+  int cnt = objects.size();
+  vector<int> parent(cnt);
+  iota(parent.begin(), parent.end(), 0);
+  auto find = [&](int x) {
+    while (parent[x] != x) {
+      x = parent[x] = parent[parent[x]];
+    }
+    return x;
+  };
+  for (const auto &contact : contacts) {
+    parent[find(contact.first)] = find(contact.second);
+  }
+
+  // an island is as quiet as its least quiet member
+  vector<double> islandQuiet(cnt, sleepTime);
+  for (int i = 0; i < cnt; ++i) {
+    auto &object = objects[i];
+    if (object->sleeping) {
+      continue;
+    }
+    if (object->isQuiet(sleepVelocity)) {
+      object->quietTime += deltaT;
+    } else {
+      object->quietTime = 0;
+    }
+    int root = find(i);
+    islandQuiet[root] = min(islandQuiet[root], object->quietTime);
+  }
+  for (int i = 0; i < cnt; ++i) {
+    auto &object = objects[i];
+    int root = find(i);
+    if (object->sleeping || islandQuiet[root] < sleepTime) {
+      continue;
+    }
+    object->sleeping = true;
+    object->island = root;
+    object->v.fill(0);
+    object->av.fill(0);
+  }
+}
+
+void FrameSystem::wake(int id) {
+  int island = objects[id]->island;
+  for (const auto &object : objects) {
+    if (object->sleeping && object->island == island) {
+      object->sleeping = false;
+      object->quietTime = 0;
+      object->island = -1;
+    }
   }
-  return;
 }
 
 // Implementation of CoreCGSystem
@@ -113,8 +438,95 @@ void CoreCGSystem::loadDataFromFile(const string &desFile) {
   }
 }
 
+bool CoreCGSystem::runBatch(const string &desFile, const string &sweepFile,
+                            int worlds, int frames, const string &output) {
+  vector<SweepParam> params;
+  if (!Loader::loadDesFile(desFile, frameSystem, false) ||
+      (!sweepFile.empty() && !WorldBatch::loadSweepFile(sweepFile, params))) {
+    return false;
+  }
+  WorldBatch batch;
+  if (!batch.init(*frameSystem, params, worlds)) {
+    return false;
+  }
+  ThreadPool threads;
+  auto start = chrono::steady_clock::now();
+  batch.run(frames, threads);
+  double seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  LOG(INFO) << worlds << " worlds x " << frames << " frames in " << seconds
+            << " s on " << threads.size() << " threads";
+  return batch.writeTable(output);
+}
+
+void CoreCGSystem::restoreFromFile(const string &snapshotFile) {
+  if (!Snapshot::loadFile(snapshotFile, *frameSystem)) {
+    LOG(FATAL) << "Failed to restore snapshot: " << snapshotFile;
+  }
+}
+
+void CoreCGSystem::saveSnapshot() {
+  if (!snapshotWriter) {
+    snapshotWriter = make_shared<SnapshotWriter>();
+  }
+  string buffer;
+  Snapshot::save(*frameSystem, buffer);
+  snapshotWriter->write(snapshotPrefix + "_" +
+                            to_string(frameSystem->frameCounter) + ".bin",
+                        move(buffer));
+}
+
+void CoreCGSystem::startRecording(const string &fileName) {
+  recorder = make_shared<TrajectoryWriter>(fileName);
+}
+
+void CoreCGSystem::recordFrame() {
+  vector<double> values;
+  values.reserve(frameSystem->objects.size() * trajectory::kChannels);
+  for (const auto &object : frameSystem->objects) {
+    values.insert(values.end(), object->pos.begin(), object->pos.end());
+    values.insert(values.end(), object->rotation.begin(),
+                  object->rotation.end());
+  }
+  recorder->push(frameSystem->frameCounter, move(values));
+}
+
+void CoreCGSystem::startPlayback(const string &fileName, double speed) {
+  player = make_shared<TrajectoryReader>();
+  if (!player->open(fileName)) {
+    LOG(FATAL) << "Failed to read trajectory file: " << fileName;
+  }
+  playSpeed = speed;
+  playCursor = 0;
+}
+
+void CoreCGSystem::playFrame() {
+  vector<double> values;
+  int frame = playCursor;
+  if (!player->read(frame, frameSystem->frameCounter, values) ||
+      values.size() != frameSystem->objects.size() * trajectory::kChannels) {
+    LOG(ERROR) << "Trajectory frame " << frame << " does not fit the scene";
+    return;
+  }
+  for (size_t i = 0; i < frameSystem->objects.size(); ++i) {
+    auto &object = frameSystem->objects[i];
+    for (int k = 0; k < 3; ++k) {
+      object->pos[k] = values[i * trajectory::kChannels + k];
+      object->rotation[k] = values[i * trajectory::kChannels + 3 + k];
+    }
+    object->calFrame();
+  }
+  // loop over the recording in either direction
+  int count = player->frameCount();
+  playCursor = fmod(playCursor + playSpeed, count);
+  if (playCursor < 0) {
+    playCursor += count;
+  }
+}
+
 // Implementation of GLUTSystem
 shared_ptr<CoreCGSystem> GLUTSystem::cgSystem = nullptr;
+shared_ptr<Object> GLUTSystem::picked = nullptr;
 
 void GLUTSystem::init(shared_ptr<CoreCGSystem> cgSystemArg) {
   cgSystem = cgSystemArg;
@@ -122,13 +534,18 @@ void GLUTSystem::init(shared_ptr<CoreCGSystem> cgSystemArg) {
 
 // frameSystem update func
 void GLUTSystem::update(void) {
-  cgSystem->frameSystem->frameCounter++;
-  for (const auto &object : cgSystem->frameSystem->objects) {
-    object->calPos(cgSystem->frameSystem->deltaT,
-                   cgSystem->frameSystem->boxSize);
-    object->calFrame();
+  if (cgSystem->player) {
+    cgSystem->playFrame();
+    return;
+  }
+  cgSystem->frameSystem->step();
+  if (cgSystem->recorder) {
+    cgSystem->recordFrame();
+  }
+  if (cgSystem->snapshotEvery > 0 &&
+      cgSystem->frameSystem->frameCounter % cgSystem->snapshotEvery == 0) {
+    cgSystem->saveSnapshot();
   }
-  cgSystem->frameSystem->collisionCheck();
 }
 // draw model func
 void GLUTSystem::drawModel(shared_ptr<Object> object, bool trans) {
@@ -154,11 +571,38 @@ void GLUTSystem::drawModel(shared_ptr<Object> object, bool trans) {
     glMultMatrixd(&(scalingMatrix.mat[0]));
   }
 
-  glColor3f(0, 0, 0);
+  glColor3f(object == picked ? 1 : 0, 0, 0);
   glCallList(object->modelID);
 
   glPopMatrix();
 }
+// draw particles func
+void GLUTSystem::drawParticles(shared_ptr<Emitter> emitter) {
+  glPointSize(emitter->size);
+  glColor3f(0, 0, 0);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glVertexPointer(3, GL_FLOAT, 0, emitter->pool.vertices.data());
+  glDrawArrays(GL_POINTS, 0, emitter->pool.count);
+  glDisableClientState(GL_VERTEX_ARRAY);
+}
+// draw fluid func
+void GLUTSystem::drawFluid(shared_ptr<Fluid> fluid) {
+  glPointSize(2);
+  glColor3f(0, 0, 0.6);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glVertexPointer(3, GL_FLOAT, 0, fluid->vertices.data());
+  glDrawArrays(GL_POINTS, 0, fluid->count);
+  glDisableClientState(GL_VERTEX_ARRAY);
+}
+// draw cloth func
+void GLUTSystem::drawCloth(shared_ptr<Cloth> cloth) {
+  glColor3f(0.6, 0, 0);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glVertexPointer(3, GL_FLOAT, 0, cloth->vertices.data());
+  glDrawElements(GL_LINES, cloth->lines.size(), GL_UNSIGNED_INT,
+                 cloth->lines.data());
+  glDisableClientState(GL_VERTEX_ARRAY);
+}
 // callback for dispaly
 void GLUTSystem::render(void) {
   // clear buffer
@@ -172,16 +616,58 @@ void GLUTSystem::render(void) {
 
   glLoadIdentity();
   drawModel(cgSystem->frameSystem->boxObj);
+  for (const auto &mesh : cgSystem->frameSystem->meshes) {
+    drawModel(mesh->model);
+  }
   // render objects
   for (const auto &object : cgSystem->frameSystem->objects) {
     drawModel(object);
   }
+  for (const auto &emitter : cgSystem->frameSystem->emitters) {
+    drawParticles(emitter);
+  }
+  if (cgSystem->frameSystem->fluid) {
+    drawFluid(cgSystem->frameSystem->fluid);
+  }
+  for (const auto &cloth : cgSystem->frameSystem->cloths) {
+    drawCloth(cloth);
+  }
 
   // swap back and front buffers
   glutSwapBuffers();
 }
 // callback for keyboard
 void GLUTSystem::keyboard(unsigned char key, int x, int y) {}
+// callback for mouse
+void GLUTSystem::mouse(int button, int state, int x, int y) {
+  if (button != GLUT_LEFT_BUTTON || state != GLUT_DOWN) {
+    return;
+  }
+  // unproject the cursor on the near and far planes of the current view
+  GLdouble model[16], proj[16];
+  GLint view[4];
+  glGetDoublev(GL_MODELVIEW_MATRIX, model);
+  glGetDoublev(GL_PROJECTION_MATRIX, proj);
+  glGetIntegerv(GL_VIEWPORT, view);
+  double winY = view[3] - y - 1;
+  vec3 near, far;
+  gluUnProject(x, winY, 0, model, proj, view, &near[0], &near[1], &near[2]);
+  gluUnProject(x, winY, 1, model, proj, view, &far[0], &far[1], &far[2]);
+  Ray ray;
+  ray.origin = near;
+  for (int k = 0; k < 3; ++k) {
+    ray.dir[k] = far[k] - near[k];
+  }
+  RayHit hit;
+  auto &fs = *cgSystem->frameSystem;
+  if (fs.query().raycast(ray, hit)) {
+    picked = fs.objects[hit.id];
+    LOG(INFO) << "Picked object " << hit.id << " at distance " << hit.t;
+  } else {
+    picked = nullptr;
+  }
+  glutPostRedisplay();
+}
 // callback for reshape
 void GLUTSystem::reshape(int w, int h) {
   glViewport(0, 0, w, h);
@@ -195,9 +681,7 @@ void GLUTSystem::reshape(int w, int h) {
 }
 // callback for timer
 void GLUTSystem::timer(int value) {
-  // increase frame index
-  cgSystem->frameSystem->frameCounter++;
-
+  // step counts the frames
   update();
 
   // render
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Frame-inl.h"
+#include "SpatialHash-inl.h"
 
 #include <GLUT/glut.h>
 #include <vector>
@@ -16,6 +17,37 @@ struct Window {
   int yPosition{100};
 };
 
+enum EngineType { ENGINE_STEP = 0, ENGINE_EVENT };
+
+class EventEngine;
+class Cloth;
+struct CollisionMesh;
+class Emitter;
+class Fluid;
+class Narrowphase;
+class ThreadPool;
+class SnapshotWriter;
+class WorldQuery;
+class TrajectoryWriter;
+class TrajectoryReader;
+
+enum IntegratorType {
+  INTEGRATOR_TRAPEZOID = 0,
+  INTEGRATOR_EULER,
+  INTEGRATOR_VERLET,
+  INTEGRATOR_ADAPTIVE
+};
+
+struct Integrator {
+  IntegratorType type{INTEGRATOR_TRAPEZOID};
+  // a frame is split into substeps until no body moves more than maxMove of
+  // its radius per substep
+  double maxMove{0.5};
+  int maxSubsteps{16};
+  // largest position error per step allowed by INTEGRATOR_ADAPTIVE
+  double tolerance{1e-3};
+};
+
 class Object {
 public:
   const static double g;
@@ -33,8 +65,19 @@ public:
   vec3 av;
   vec3 rotation;
 
+  // resting bodies are put to sleep and skip integration until touched
+  bool sleeping{false};
+  double quietTime{0};
+  int island{-1};
+  // last accepted step of INTEGRATOR_ADAPTIVE
+  double stepSize{0};
+
+  bool isQuiet(double sleepVelocity) const;
   void calFrame();
-  void calPos(const double& deltaT, double boxSize);
+  vec3 calVel(const double &deltaT, double boxSize) const;
+  void spin(double boxSize);
+  void calPos(const double &deltaT, double boxSize,
+              const Integrator &integrator);
   void boxCheck(double boxSize);
 };
 
@@ -44,18 +87,65 @@ public:
   double deltaT{0.01};
   double offsetT{0};
   int fps{120};
+  // fixed deltaT stepping or the event-driven hard-sphere engine
+  EngineType engine{ENGINE_STEP};
+  shared_ptr<EventEngine> eventEngine;
+  Integrator integrator;
 
   double boxSize;
   shared_ptr<Object> boxObj;
   vector<shared_ptr<Object>> objects;
-
+  vector<shared_ptr<Emitter>> emitters;
+  // SPH fluid sharing the box with the balls, its kernels run on threadPool
+  shared_ptr<Fluid> fluid;
+  shared_ptr<ThreadPool> threadPool;
+  vector<shared_ptr<Cloth>> cloths;
+  // static triangle meshes the balls bounce off under ENGINE_STEP
+  vector<shared_ptr<CollisionMesh>> meshes;
+
+  // an island of touching bodies sleeps once all of them have stayed below
+  // sleepVelocity for sleepTime seconds, sleepTime <= 0 disables sleeping
+  // and is the default, a sleep line turns it on
+  double sleepTime{0};
+  double sleepVelocity{0.5};
+
+  SpatialHash broadphase;
+  vector<pair<int, int>> pairs;
+  vector<pair<int, int>> contacts;
+  // batched sphere-sphere tests and impulses of collisionCheck
+  shared_ptr<Narrowphase> narrowphase;
+  vector<int> segment;
+
+  void step();
+  int calSubsteps() const;
+  void indexBroadphase();
+  void updateBroadphase();
   void collisionCheck();
+  void meshCheck();
+  void updateSleeping();
+  void wake(int id);
+  // ray, sphere-cast and overlap queries over the current positions, valid
+  // until objects are added or removed. The first call of a frame indexes
+  // the objects, later ones reuse that.
+  WorldQuery query();
+  int queryFrame{-1};
+  vec3 queryLo, queryHi;
 };
 
 class CoreCGSystem {
 public:
   shared_ptr<Window> window;
   shared_ptr<FrameSystem> frameSystem;
+  // write a snapshot every snapshotEvery frames, 0 disables
+  int snapshotEvery{0};
+  string snapshotPrefix{"snapshot"};
+  shared_ptr<SnapshotWriter> snapshotWriter;
+  // record every frame to a trajectory file, or replay one instead of
+  // simulating at playSpeed recorded frames per frame
+  shared_ptr<TrajectoryWriter> recorder;
+  shared_ptr<TrajectoryReader> player;
+  double playSpeed{1};
+  double playCursor{0};
 
   CoreCGSystem() {
     window = make_shared<Window>();
@@ -63,11 +153,23 @@ public:
   };
 
   void loadDataFromFile(const string &desFile);
+  void restoreFromFile(const string &snapshotFile);
+  void saveSnapshot();
+  void startRecording(const string &fileName);
+  void recordFrame();
+  void startPlayback(const string &fileName, double speed);
+  void playFrame();
+  // step worlds copies of the scene for frames frames with the parameters
+  // of sweepFile spread over them and write one csv row per world
+  bool runBatch(const string &desFile, const string &sweepFile, int worlds,
+                int frames, const string &output);
 };
 
 class GLUTSystem {
 private:
   static shared_ptr<CoreCGSystem> cgSystem;
+  // object under the last click, drawn in red
+  static shared_ptr<Object> picked;
 
 public:
   static void init(shared_ptr<CoreCGSystem> cgSystem);
@@ -75,10 +177,18 @@ public:
   static void update(void);
   // draw model func
   static void drawModel(shared_ptr<Object> object, bool trans = true);
+  // draw every live particle of an emitter as points
+  static void drawParticles(shared_ptr<Emitter> emitter);
+  // draw the fluid particles as points
+  static void drawFluid(shared_ptr<Fluid> fluid);
+  // draw the structural edges of a cloth as lines
+  static void drawCloth(shared_ptr<Cloth> cloth);
   // callback for dispaly
   static void render(void);
   // callback for keyboard
   static void keyboard(unsigned char key, int x, int y);
+  // callback for mouse, a left click picks the object under the cursor
+  static void mouse(int button, int state, int x, int y);
   // callback for reshape
   static void reshape(int w, int h);
   // callback for timer
@@ -0,0 +1,372 @@
+#pragma once
+
+#include "SystemDS.h"
+#include "ThreadPool-inl.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <glog/logging.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace ICG {
+
+// one swept parameter, object -1 applies it to every object
+struct SweepParam {
+  string name;
+  int object{-1};
+  double lo, hi;
+};
+
+// Thousands of copies of one small scene stepped in lockstep, differing only
+// in the swept parameters. Every field is stored as [object][axis][world] so
+// the inner loops run over contiguous worlds, blocks of kBlock worlds are
+// simulated on the thread pool and never synchronize. Each world follows
+// FrameSystem::step under ENGINE_STEP and INTEGRATOR_TRAPEZOID exactly,
+// including its own substep count, with sleeping disabled. Only balls and
+// the box are simulated.
+class WorldBatch {
+public:
+  int worlds{0};
+  int count{0};
+  vector<SweepParam> params;
+  // values[p * worlds + w] is parameter p of world w
+  vector<double> values;
+
+  // lines of "name object lo hi" with name one of cofRes friction mass vx vy
+  // vz px py pz and object an index or * for all
+  static bool loadSweepFile(const string &fileName,
+                            vector<SweepParam> &params) {
+    ifstream sweepFile(fileName);
+    if (not sweepFile.is_open()) {
+      LOG(ERROR) << "Cannot open sweep file: " << fileName;
+      return false;
+    }
+    string line;
+    while (getline(sweepFile, line)) {
+      istringstream lineStream(line);
+      SweepParam param;
+      string object;
+      if (!(lineStream >> param.name) || param.name[0] == '#') {
+        continue;
+      }
+      if (!(lineStream >> object >> param.lo >> param.hi) ||
+          field(param.name) < 0) {
+        LOG(ERROR) << "Bad sweep line: " << line;
+        return false;
+      }
+      istringstream objectStream(object);
+      if (object != "*" && !(objectStream >> param.object)) {
+        LOG(ERROR) << "Bad sweep object: " << line;
+        return false;
+      }
+      params.emplace_back(param);
+    }
+    return true;
+  }
+
+  // copy the scene into every world, then spread the parameters over
+  // [lo, hi] with a Halton sequence so any prefix of worlds covers the
+  // space evenly
+  bool init(const FrameSystem &fs, const vector<SweepParam> &sweep, int n) {
+    if (fs.cloths.size() || fs.meshes.size() || fs.emitters.size() ||
+        fs.fluid) {
+      LOG(WARNING) << "Batch worlds only simulate the balls and the box";
+    }
+    if (fs.engine != ENGINE_STEP ||
+        fs.integrator.type != INTEGRATOR_TRAPEZOID) {
+      LOG(WARNING) << "Batch worlds always use the step engine and the "
+                      "trapezoid integrator";
+    }
+    worlds = n;
+    count = fs.objects.size();
+    params = sweep;
+    boxSize = fs.boxSize;
+    deltaT = fs.deltaT;
+    sleepVelocity = fs.sleepVelocity;
+    integrator = fs.integrator;
+    radius.resize(count);
+    for (auto array : {&pos, &v}) {
+      array->assign(count * 3 * worlds, 0);
+    }
+    for (auto array : {&mass, &friction, &cofRes}) {
+      array->assign(count * worlds, 0);
+    }
+    for (int j = 0; j < count; ++j) {
+      const auto &object = *fs.objects[j];
+      radius[j] = object.radius;
+      for (int w = 0; w < worlds; ++w) {
+        for (int k = 0; k < 3; ++k) {
+          pos[at(j, k, w)] = object.pos[k];
+          v[at(j, k, w)] = object.v[k];
+        }
+        mass[j * worlds + w] = object.mass;
+        friction[j * worlds + w] = object.friction;
+        cofRes[j * worlds + w] = object.cofRes;
+      }
+    }
+    values.resize(params.size() * worlds);
+    for (size_t p = 0; p < params.size(); ++p) {
+      const auto &param = params[p];
+      if (param.object >= count) {
+        LOG(ERROR) << "Sweep of " << param.name << " names object "
+                   << param.object << ", scene has " << count;
+        return false;
+      }
+      for (int w = 0; w < worlds; ++w) {
+        double value = param.lo + (param.hi - param.lo) * halton(w + 1, p);
+        values[p * worlds + w] = value;
+        for (int j = 0; j < count; ++j) {
+          if (param.object < 0 || param.object == j) {
+            *slot(param.name, j, w) = value;
+          }
+        }
+      }
+    }
+    collisions.assign(worlds, 0);
+    settleFrame.assign(worlds, 0);
+    return true;
+  }
+
+  void run(int frames, ThreadPool &threads) {
+    int blocks = (worlds + kBlock - 1) / kBlock;
+    threads.parallelFor(blocks, 1, [&](int begin, int end) {
+      for (int b = begin; b < end; ++b) {
+        int first = b * kBlock, last = min(worlds, first + (int)kBlock);
+        for (int frame = 1; frame <= frames; ++frame) {
+          step(first, last, frame);
+        }
+      }
+    });
+  }
+
+  // one row per world: its parameters, final state and metrics
+  bool writeTable(const string &fileName) const {
+    ofstream table(fileName);
+    if (not table.is_open()) {
+      LOG(ERROR) << "Cannot open batch output: " << fileName;
+      return false;
+    }
+    table << "world";
+    for (const auto &param : params) {
+      table << "," << param.name << "_"
+            << (param.object < 0 ? string("all") : to_string(param.object));
+    }
+    for (int j = 0; j < count; ++j) {
+      for (auto name : {"px", "py", "pz", "vx", "vy", "vz"}) {
+        table << "," << name << j;
+      }
+    }
+    table << ",collisions,settle_frame,energy\n";
+    table.precision(10);
+    for (int w = 0; w < worlds; ++w) {
+      table << w;
+      for (size_t p = 0; p < params.size(); ++p) {
+        table << "," << values[p * worlds + w];
+      }
+      double energy = 0;
+      for (int j = 0; j < count; ++j) {
+        for (auto array : {&pos, &v}) {
+          for (int k = 0; k < 3; ++k) {
+            table << "," << (*array)[at(j, k, w)];
+          }
+        }
+        double m = mass[j * worlds + w], speed2 = 0;
+        for (int k = 0; k < 3; ++k) {
+          speed2 += v[at(j, k, w)] * v[at(j, k, w)];
+        }
+        energy += m * speed2 / 2 + m * Object::g * (pos[at(j, 1, w)] + boxSize);
+      }
+      table << "," << collisions[w] << "," << settleFrame[w] << "," << energy
+            << "\n";
+    }
+    return bool(table);
+  }
+
+  double position(int object, int axis, int world) const {
+    return pos[at(object, axis, world)];
+  }
+
+private:
+  static const int kBlock = 64;
+
+  double boxSize;
+  double deltaT;
+  double sleepVelocity;
+  Integrator integrator;
+  vector<double> radius;
+  vector<double> pos, v;
+  vector<double> mass, friction, cofRes;
+  // collisions resolved and the last frame any ball moved faster than
+  // sleepVelocity
+  vector<int> collisions, settleFrame;
+
+  int at(int object, int axis, int world) const {
+    return (object * 3 + axis) * worlds + world;
+  }
+
+  static int field(const string &name) {
+    const char *names[] = {"cofRes", "friction", "mass", "vx", "vy",
+                           "vz",     "px",       "py",   "pz"};
+    for (int i = 0; i < 9; ++i) {
+      if (name == names[i]) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  double *slot(const string &name, int object, int world) {
+    int f = field(name);
+    int i = object * worlds + world;
+    switch (f) {
+    case 0:
+      return &cofRes[i];
+    case 1:
+      return &friction[i];
+    case 2:
+      return &mass[i];
+    case 3:
+    case 4:
+    case 5:
+      return &v[at(object, f - 3, world)];
+    default:
+      return &pos[at(object, f - 6, world)];
+    }
+  }
+
+  static double halton(int index, int dimension) {
+    static const int primes[] = {2,  3,  5,  7,  11, 13, 17, 19,
+                                 23, 29, 31, 37, 41, 43, 47, 53};
+    int base = primes[dimension % 16];
+    double f = 1, r = 0;
+    for (; index > 0; index /= base) {
+      f /= base;
+      r += f * (index % base);
+    }
+    return r;
+  }
+
+  // FrameSystem::step for worlds [first, last), written lane by lane
+  void step(int first, int last, int frame) {
+    const double g = Object::g, eps = Object::eps;
+    int n = last - first;
+    int substeps[kBlock];
+    double dt[kBlock];
+    int maxSubsteps = 1;
+    for (int l = 0; l < n; ++l) {
+      int w = first + l;
+      double ratio = 0;
+      for (int j = 0; j < count; ++j) {
+        double speed = sqrt(v[at(j, 0, w)] * v[at(j, 0, w)] +
+                            v[at(j, 1, w)] * v[at(j, 1, w)] +
+                            v[at(j, 2, w)] * v[at(j, 2, w)]);
+        ratio = max(ratio, speed * deltaT / (integrator.maxMove * radius[j]));
+      }
+      substeps[l] = max(1, min(integrator.maxSubsteps, (int)ceil(ratio)));
+      dt[l] = deltaT / substeps[l];
+      maxSubsteps = max(maxSubsteps, substeps[l]);
+    }
+
+    for (int s = 0; s < maxSubsteps; ++s) {
+      for (int j = 0; j < count; ++j) {
+        double r = radius[j];
+        double *px = &pos[at(j, 0, first)], *py = &pos[at(j, 1, first)],
+               *pz = &pos[at(j, 2, first)];
+        double *vx = &v[at(j, 0, first)], *vy = &v[at(j, 1, first)],
+               *vz = &v[at(j, 2, first)];
+        const double *mu = &friction[j * worlds + first];
+        const double *e = &cofRes[j * worlds + first];
+        for (int l = 0; l < n; ++l) {
+          if (s >= substeps[l]) {
+            continue;
+          }
+          // Object::calVel
+          double ground = abs(py[l] - r + boxSize);
+          bool hitGround = ground < eps, touchGround = ground < 1e-1;
+          double nv[3] = {vx[l], hitGround ? vy[l] : vy[l] - g * dt[l],
+                          vz[l]};
+          double *vk[3] = {vx, vy, vz};
+          for (int k = 0; k < 3; k += 2) {
+            double vprime = abs(vk[k][l]) - g * mu[l] * dt[l];
+            if (touchGround) {
+              nv[k] = vprime > 0 ? (vk[k][l] / abs(vk[k][l])) * vprime : 0;
+            }
+          }
+          // trapezoid step and Object::boxCheck
+          double *pk[3] = {px, py, pz};
+          for (int k = 0; k < 3; ++k) {
+            pk[k][l] += (nv[k] + vk[k][l]) / 2 * dt[l];
+            vk[k][l] = nv[k];
+          }
+          for (int k = 0; k < 3; ++k) {
+            double posCur = pk[k][l] + (k == 2 ? 3 * boxSize : 0);
+            if (posCur - r <= -boxSize) {
+              vk[k][l] = abs(vk[k][l]) * e[l];
+            }
+            if (posCur + r >= boxSize) {
+              vk[k][l] = -abs(vk[k][l]) * e[l];
+            }
+            if (abs(vk[k][l]) < eps) {
+              vk[k][l] = 0;
+            }
+          }
+        }
+      }
+      collide(first, n, s, substeps);
+    }
+
+    for (int l = 0; l < n; ++l) {
+      int w = first + l;
+      for (int j = 0; j < count; ++j) {
+        double speed2 = 0;
+        for (int k = 0; k < 3; ++k) {
+          speed2 += v[at(j, k, w)] * v[at(j, k, w)];
+        }
+        if (speed2 >= sleepVelocity * sleepVelocity) {
+          settleFrame[w] = frame;
+        }
+      }
+    }
+  }
+
+  // FrameSystem::collisionCheck, pairs in the same sorted order
+  void collide(int first, int n, int s, const int *substeps) {
+    for (int i = 0; i < count; ++i) {
+      for (int j = i + 1; j < count; ++j) {
+        double rr = radius[i] + radius[j];
+        for (int l = 0; l < n; ++l) {
+          int w = first + l;
+          if (s >= substeps[l]) {
+            continue;
+          }
+          double sum = 0;
+          for (int k = 0; k < 3; ++k) {
+            double d = pos[at(i, k, w)] - pos[at(j, k, w)];
+            sum += d * d;
+          }
+          if (sqrt(sum) + 1e-3 > rr) {
+            continue;
+          }
+          collisions[w]++;
+          double mi = mass[i * worlds + w], mj = mass[j * worlds + w];
+          double ei = cofRes[i * worlds + w], ej = cofRes[j * worlds + w];
+          for (int k = 0; k < 3; ++k) {
+            double &vi = v[at(i, k, w)], &vj = v[at(j, k, w)];
+            double moSum = mi * vi + mj * vj;
+            double ni = (moSum + ei * mj * (vj - vi)) / (mi + mj);
+            double nj = (moSum + ej * mi * (vi - vj)) / (mi + mj);
+            vi = ni;
+            vj = nj;
+          }
+        }
+      }
+    }
+  }
+};
+
+} // namespace ICG
@@ -11,6 +11,17 @@
 #include <GLUT/glut.h>
 
 DEFINE_string(des_file, "../files/psys.des", "path to the des File");
+DEFINE_string(restore, "", "snapshot file to continue the scene from");
+DEFINE_int32(snapshot_every, 0, "write a snapshot every n frames, 0 disables");
+DEFINE_string(snapshot_prefix, "snapshot", "path prefix of snapshot files");
+DEFINE_string(record, "", "record the trajectory of every object to this file");
+DEFINE_string(play, "", "replay a recorded trajectory instead of simulating");
+DEFINE_double(play_speed, 1.0, "recorded frames per rendered frame");
+DEFINE_int32(batch_worlds, 0,
+             "simulate this many copies of the scene without a window");
+DEFINE_int32(batch_frames, 600, "frames every batch world is stepped");
+DEFINE_string(batch_sweep, "", "parameters swept over the batch worlds");
+DEFINE_string(batch_output, "batch.csv", "table of the batch results");
 
 using namespace ICG;
 
@@ -21,6 +32,13 @@ int main(int argc, char *argv[]) {
 
   // init CoreCGSystem
   auto cgSystem = make_shared<CoreCGSystem>();
+  if (FLAGS_batch_worlds > 0) {
+    return cgSystem->runBatch(FLAGS_des_file, FLAGS_batch_sweep,
+                              FLAGS_batch_worlds, FLAGS_batch_frames,
+                              FLAGS_batch_output)
+               ? 0
+               : 1;
+  }
 
   // create opengL window
   glutInit(&argc, argv);
@@ -32,6 +50,17 @@ int main(int argc, char *argv[]) {
 
   // load Files
   cgSystem->loadDataFromFile(FLAGS_des_file);
+  if (!FLAGS_restore.empty()) {
+    cgSystem->restoreFromFile(FLAGS_restore);
+  }
+  cgSystem->snapshotEvery = FLAGS_snapshot_every;
+  cgSystem->snapshotPrefix = FLAGS_snapshot_prefix;
+  if (!FLAGS_record.empty()) {
+    cgSystem->startRecording(FLAGS_record);
+  }
+  if (!FLAGS_play.empty()) {
+    cgSystem->startPlayback(FLAGS_play, FLAGS_play_speed);
+  }
   // init GLUTSystem
   GLUTSystem::init(cgSystem);
 
@@ -39,6 +68,7 @@ int main(int argc, char *argv[]) {
   glutDisplayFunc(GLUTSystem::render);
   glutReshapeFunc(GLUTSystem::reshape);
   glutKeyboardFunc(GLUTSystem::keyboard);
+  glutMouseFunc(GLUTSystem::mouse);
   glutTimerFunc(1000.0 / cgSystem->frameSystem->fps, GLUTSystem::timer, 0);
   // main loop
   glutMainLoop();
@@ -0,0 +1,443 @@
+#pragma once
+
+#include "ThreadPool-inl.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <glog/logging.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace ICG {
+
+struct Triangle {
+  array<double, 3> a, b, c;
+};
+
+// closest point to p on triangle t, from Ericson's Real-Time Collision
+// Detection 5.1.5
+inline array<double, 3> closestOnTriangle(const array<double, 3> &p,
+                                          const Triangle &t) {
+  typedef array<double, 3> point;
+  auto sub = [](const point &u, const point &v) {
+    return point{u[0] - v[0], u[1] - v[1], u[2] - v[2]};
+  };
+  auto dot = [](const point &u, const point &v) {
+    return u[0] * v[0] + u[1] * v[1] + u[2] * v[2];
+  };
+  auto at = [&](double s, double r) {
+    point q;
+    for (int k = 0; k < 3; ++k) {
+      q[k] = t.a[k] + s * (t.b[k] - t.a[k]) + r * (t.c[k] - t.a[k]);
+    }
+    return q;
+  };
+  point ab = sub(t.b, t.a), ac = sub(t.c, t.a), ap = sub(p, t.a);
+  double d1 = dot(ab, ap), d2 = dot(ac, ap);
+  if (d1 <= 0 && d2 <= 0) {
+    return t.a;
+  }
+  point bp = sub(p, t.b);
+  double d3 = dot(ab, bp), d4 = dot(ac, bp);
+  if (d3 >= 0 && d4 <= d3) {
+    return t.b;
+  }
+  double vc = d1 * d4 - d3 * d2;
+  if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+    return at(d1 / (d1 - d3), 0);
+  }
+  point cp = sub(p, t.c);
+  double d5 = dot(ab, cp), d6 = dot(ac, cp);
+  if (d6 >= 0 && d5 <= d6) {
+    return t.c;
+  }
+  double vb = d5 * d2 - d1 * d6;
+  if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+    return at(0, d2 / (d2 - d6));
+  }
+  double va = d3 * d6 - d5 * d4;
+  if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+    double w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+    return at(1 - w, w);
+  }
+  double denom = 1 / (va + vb + vc);
+  return at(vb * denom, vc * denom);
+}
+
+// Signed distance to a set of static bodies sampled on a grid, negative
+// inside. Every node also keeps the unit gradient and the radius of the
+// closest body, so the force of the whole set on an agent is one trilinear
+// lookup whatever the number of bodies. Spheres are exact; a triangle mesh
+// takes the distance to its closest triangle, signed by its winding number
+// so small holes in the mesh do not flip the inside. The field is exact up
+// to margin from the bodies and reads margin beyond, so only the bricks of
+// kBrick^3 cells near a body are stored, each with its own kSide^3 nodes,
+// and memory follows the surfaces rather than the volume. Bricks are baked
+// in parallel, each against the bodies that reach it, and the result is
+// cached under a fingerprint of the inputs.
+class DistanceField {
+public:
+  typedef array<double, 3> point;
+  static const int kBrick = 4;
+  // a brick repeats the first nodes of the next one so a lookup stays in it
+  static const int kSide = kBrick + 1;
+
+  // a sphere, or the surface of shape bounded by it
+  struct Body {
+    point center;
+    double radius;
+    const vector<Triangle> *shape;
+  };
+
+  struct Node {
+    float dis;
+    float grad[3];
+    float radius;
+  };
+
+  struct Sample {
+    // HUGE_VAL outside the grid
+    double dis;
+    point grad;
+    double radius;
+  };
+
+  point lo{0, 0, 0};
+  double cell{1};
+  double margin{0};
+  array<int, 3> bricks{{0, 0, 0}};
+  // first node of every brick, -1 where no body is within margin
+  vector<int> first;
+  vector<Node> nodes;
+
+  // false if the bricks would not fit in memory
+  bool build(const vector<Body> &bodies, double cellSize, double marginSize,
+             ThreadPool &pool) {
+    cell = cellSize;
+    margin = marginSize;
+    point hi{-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+    lo = {HUGE_VAL, HUGE_VAL, HUGE_VAL};
+    for (const auto &body : bodies) {
+      for (int k = 0; k < 3; ++k) {
+        lo[k] = min(lo[k], body.center[k] - body.radius - margin);
+        hi[k] = max(hi[k], body.center[k] + body.radius + margin);
+      }
+    }
+    int64_t count = 1;
+    for (int k = 0; k < 3; ++k) {
+      bricks[k] = bodies.empty()
+                      ? 1
+                      : max(1, (int)ceil((hi[k] - lo[k]) / cell / kBrick));
+      count *= bricks[k];
+    }
+    if (count > kMaxNodes) {
+      LOG(ERROR) << "Distance field of " << count << " bricks is too fine";
+      return false;
+    }
+    // bodies reaching every brick, counted then filled
+    first.assign(count, -1);
+    vector<int> reached(count + 1, 0), reaching;
+    for (int pass = 0; pass < 2; ++pass) {
+      for (size_t i = 0; i < bodies.size(); ++i) {
+        forBricks(bodies[i], [&](int64_t b) {
+          if (pass == 0) {
+            reached[b + 1]++;
+          } else {
+            reaching[reached[b]++] = i;
+          }
+        });
+      }
+      if (pass == 0) {
+        for (int64_t b = 0; b < count; ++b) {
+          reached[b + 1] += reached[b];
+        }
+        reaching.resize(reached[count]);
+      } else {
+        // the fill moved every start to the next brick
+        for (int64_t b = count; b > 0; --b) {
+          reached[b] = reached[b - 1];
+        }
+        reached[0] = 0;
+      }
+    }
+    vector<int64_t> live;
+    for (int64_t b = 0; b < count; ++b) {
+      if (reached[b + 1] > reached[b]) {
+        first[b] = live.size() * kSide * kSide * kSide;
+        live.emplace_back(b);
+      }
+    }
+    if ((int64_t)live.size() * kSide * kSide * kSide > kMaxNodes) {
+      LOG(ERROR) << "Distance field of " << live.size()
+                 << " bricks is too fine";
+      return false;
+    }
+    nodes.assign(live.size() * kSide * kSide * kSide, Node());
+    pool.parallelFor(live.size(), 4, [&](int begin, int end) {
+      vector<const Body *> near;
+      for (int g = begin; g < end; ++g) {
+        int64_t b = live[g];
+        near.clear();
+        for (int j = reached[b]; j < reached[b + 1]; ++j) {
+          near.emplace_back(&bodies[reaching[j]]);
+        }
+        int corner[3] = {int(b % bricks[0] * kBrick),
+                         int(b / bricks[0] % bricks[1] * kBrick),
+                         int(b / bricks[0] / bricks[1] * kBrick)};
+        Node *node = &nodes[first[b]];
+        for (int z = 0; z < kSide; ++z) {
+          for (int y = 0; y < kSide; ++y) {
+            for (int x = 0; x < kSide; ++x) {
+              *node++ = bake(point{lo[0] + (corner[0] + x) * cell,
+                                   lo[1] + (corner[1] + y) * cell,
+                                   lo[2] + (corner[2] + z) * cell},
+                             near, margin);
+            }
+          }
+        }
+      }
+    });
+    return true;
+  }
+
+  Sample sample(const point &p) const {
+    int c[3];
+    double f[3];
+    for (int k = 0; k < 3; ++k) {
+      double x = (p[k] - lo[k]) / cell;
+      if (!(x >= 0 && x <= bricks[k] * kBrick)) {
+        return Sample{HUGE_VAL, {0, 0, 0}, 0};
+      }
+      c[k] = min((int)x, bricks[k] * kBrick - 1);
+      f[k] = x - c[k];
+    }
+    int at = first[((int64_t)c[2] / kBrick * bricks[1] + c[1] / kBrick) *
+                       bricks[0] +
+                   c[0] / kBrick];
+    if (at < 0) {
+      return Sample{margin, {0, 0, 0}, 0};
+    }
+    at += ((c[2] % kBrick) * kSide + c[1] % kBrick) * kSide + c[0] % kBrick;
+    double dis = 0, radius = 0;
+    point grad{0, 0, 0};
+    for (int corner = 0; corner < 8; ++corner) {
+      double w = 1;
+      for (int k = 0; k < 3; ++k) {
+        w *= corner >> k & 1 ? f[k] : 1 - f[k];
+      }
+      const auto &node = nodes[at + (corner >> 2 & 1) * kSide * kSide +
+                               (corner >> 1 & 1) * kSide + (corner & 1)];
+      dis += w * node.dis;
+      radius += w * node.radius;
+      for (int k = 0; k < 3; ++k) {
+        grad[k] += w * node.grad[k];
+      }
+    }
+    double len =
+        sqrt(grad[0] * grad[0] + grad[1] * grad[1] + grad[2] * grad[2]);
+    for (int k = 0; k < 3; ++k) {
+      grad[k] = len > 0 ? grad[k] / len : 0;
+    }
+    return Sample{dis, grad, radius};
+  }
+
+  static uint64_t fingerprint(const vector<Body> &bodies, double cellSize,
+                              double marginSize) {
+    // FNV-1a over every input of the build
+    uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&](double value) {
+      unsigned char bytes[sizeof(double)];
+      memcpy(bytes, &value, sizeof(double));
+      for (unsigned char byte : bytes) {
+        hash = (hash ^ byte) * 1099511628211ULL;
+      }
+    };
+    mix(kVersion), mix(cellSize), mix(marginSize), mix(bodies.size());
+    for (const auto &body : bodies) {
+      mix(body.center[0]), mix(body.center[1]), mix(body.center[2]);
+      mix(body.radius);
+      mix(body.shape ? body.shape->size() : -1.0);
+      if (body.shape) {
+        for (const auto &t : *body.shape) {
+          for (const auto *v : {&t.a, &t.b, &t.c}) {
+            mix((*v)[0]), mix((*v)[1]), mix((*v)[2]);
+          }
+        }
+      }
+    }
+    return hash;
+  }
+
+  // false unless fileName holds a field built with key
+  bool load(const string &fileName, uint64_t key) {
+    ifstream file(fileName, ios::in | ios::binary);
+    int32_t magic = 0, version = 0;
+    uint64_t stored = 0;
+    file.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    file.read(reinterpret_cast<char *>(&version), sizeof(version));
+    file.read(reinterpret_cast<char *>(&stored), sizeof(stored));
+    if (!file || magic != kMagic || version != kVersion || stored != key) {
+      return false;
+    }
+    int64_t count = 0;
+    file.read(reinterpret_cast<char *>(lo.data()), sizeof(lo));
+    file.read(reinterpret_cast<char *>(&cell), sizeof(cell));
+    file.read(reinterpret_cast<char *>(&margin), sizeof(margin));
+    file.read(reinterpret_cast<char *>(bricks.data()), sizeof(bricks));
+    file.read(reinterpret_cast<char *>(&count), sizeof(count));
+    int64_t brickCount = (int64_t)bricks[0] * bricks[1] * bricks[2];
+    if (!file || bricks[0] < 1 || bricks[1] < 1 || bricks[2] < 1 ||
+        brickCount > kMaxNodes || count < 0 || count > kMaxNodes) {
+      return false;
+    }
+    first.resize(brickCount);
+    nodes.resize(count);
+    file.read(reinterpret_cast<char *>(first.data()),
+              brickCount * sizeof(int));
+    file.read(reinterpret_cast<char *>(nodes.data()), count * sizeof(Node));
+    if (!file || file.peek() != EOF) {
+      return false;
+    }
+    for (int at : first) {
+      if (at < -1 || at > count - kSide * kSide * kSide) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool save(const string &fileName, uint64_t key) const {
+    ofstream file(fileName, ios::out | ios::binary | ios::trunc);
+    int32_t magic = kMagic, version = kVersion;
+    int64_t count = nodes.size();
+    file.write(reinterpret_cast<const char *>(&magic), sizeof(magic));
+    file.write(reinterpret_cast<const char *>(&version), sizeof(version));
+    file.write(reinterpret_cast<const char *>(&key), sizeof(key));
+    file.write(reinterpret_cast<const char *>(lo.data()), sizeof(lo));
+    file.write(reinterpret_cast<const char *>(&cell), sizeof(cell));
+    file.write(reinterpret_cast<const char *>(&margin), sizeof(margin));
+    file.write(reinterpret_cast<const char *>(bricks.data()), sizeof(bricks));
+    file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    file.write(reinterpret_cast<const char *>(first.data()),
+               first.size() * sizeof(int));
+    file.write(reinterpret_cast<const char *>(nodes.data()),
+               nodes.size() * sizeof(Node));
+    return bool(file);
+  }
+
+private:
+  static const int32_t kMagic = 0x46474349; // "ICGF"
+  static const int32_t kVersion = 1;
+  static const int64_t kMaxNodes = 1 << 26;
+
+  // every brick whose box comes within margin of body
+  template <typename Func> void forBricks(const Body &body, Func func) const {
+    double reach = body.radius + margin, size = cell * kBrick;
+    int from[3], to[3];
+    for (int k = 0; k < 3; ++k) {
+      from[k] = max(0, (int)floor((body.center[k] - reach - lo[k]) / size));
+      to[k] = min(bricks[k] - 1,
+                  (int)floor((body.center[k] + reach - lo[k]) / size));
+    }
+    for (int z = from[2]; z <= to[2]; ++z) {
+      for (int y = from[1]; y <= to[1]; ++y) {
+        for (int x = from[0]; x <= to[0]; ++x) {
+          int at[3] = {x, y, z};
+          double d2 = 0;
+          for (int k = 0; k < 3; ++k) {
+            double near = lo[k] + at[k] * size, far = near + size;
+            double gap = max(max(near - body.center[k], body.center[k] - far),
+                             0.0);
+            d2 += gap * gap;
+          }
+          if (d2 < reach * reach) {
+            func(((int64_t)z * bricks[1] + y) * bricks[0] + x);
+          }
+        }
+      }
+    }
+  }
+
+  // fraction of a full turn the triangle covers seen from p, from Van
+  // Oosterom and Strackee
+  static double solidAngle(const point &p, const Triangle &t) {
+    point a, b, c;
+    for (int k = 0; k < 3; ++k) {
+      a[k] = t.a[k] - p[k], b[k] = t.b[k] - p[k], c[k] = t.c[k] - p[k];
+    }
+    auto dot = [](const point &u, const point &v) {
+      return u[0] * v[0] + u[1] * v[1] + u[2] * v[2];
+    };
+    double la = sqrt(dot(a, a)), lb = sqrt(dot(b, b)), lc = sqrt(dot(c, c));
+    double det = a[0] * (b[1] * c[2] - b[2] * c[1]) -
+                 a[1] * (b[0] * c[2] - b[2] * c[0]) +
+                 a[2] * (b[0] * c[1] - b[1] * c[0]);
+    double div =
+        la * lb * lc + dot(a, b) * lc + dot(a, c) * lb + dot(b, c) * la;
+    return atan2(det, div) / (2 * M_PI);
+  }
+
+  static Node bake(const point &p, const vector<const Body *> &near,
+                   double limit) {
+    double best = limit, radius = 0;
+    point grad{0, 0, 0};
+    for (const auto *at : near) {
+      const auto &body = *at;
+      point d;
+      for (int k = 0; k < 3; ++k) {
+        d[k] = p[k] - body.center[k];
+      }
+      double len = sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+      // a shape is inside its sphere, so it is no closer than the sphere
+      double dis = len - body.radius;
+      if (dis >= best) {
+        continue;
+      }
+      point toward = d;
+      if (body.shape && !body.shape->empty()) {
+        double d2 = HUGE_VAL, winding = 0;
+        for (const auto &t : *body.shape) {
+          point q = closestOnTriangle(p, t);
+          double e2 = 0;
+          for (int k = 0; k < 3; ++k) {
+            e2 += (p[k] - q[k]) * (p[k] - q[k]);
+          }
+          if (e2 < d2) {
+            d2 = e2;
+            for (int k = 0; k < 3; ++k) {
+              toward[k] = p[k] - q[k];
+            }
+          }
+          winding += solidAngle(p, t);
+        }
+        len = sqrt(d2);
+        dis = len;
+        // winding is +-1 inside depending on the face order
+        if (abs(winding) > 0.5) {
+          dis = -dis;
+          for (auto &x : toward) {
+            x = -x;
+          }
+        }
+        if (dis >= best) {
+          continue;
+        }
+      }
+      best = dis;
+      radius = body.radius;
+      for (int k = 0; k < 3; ++k) {
+        grad[k] = len > 0 ? toward[k] / len : k == 2;
+      }
+    }
+    return Node{(float)best, {(float)grad[0], (float)grad[1], (float)grad[2]},
+                (float)radius};
+  }
+};
+
+} // namespace ICG
@@ -1,16 +1,18 @@
 #pragma once
 
+#include "DistanceField-inl.h"
 #include "Frame-inl.h"
 #include "MatrixOp-inl.h"
+#include "PoissonDisk-inl.h"
 #include "SystemDS.h"
 
 #include <GLUT/glut.h>
 #include <array>
-#include <cstdlib>
 #include <cassert>
 #include <fstream>
 #include <glog/logging.h>
 #include <iostream>
+#include <set>
 #include <sstream>
 #include <string>
 #include <unordered_map>
@@ -52,7 +54,14 @@ public:
       return false;
     }
     string line;
-    srand(0);
+    fSystem->seed = 0;
+    struct Override {
+      int target, source;
+      ForceTerm term;
+    };
+    vector<Override> overrides;
+    double fieldCell = 0, fieldMargin = 0;
+    string fieldCache;
     while (!desFile.eof()) {
       getline(desFile, line);
       if (line.size() == 0) {
@@ -64,8 +73,38 @@ public:
       lineStream >> token;
       if (token == "#") {
         continue;
+      } else if (token == "seed") {
+        // keys the random draws of the lines after it
+        lineStream >> fSystem->seed;
       } else if (token == "dt") {
         lineStream >> fSystem->deltaT;
+      } else if (token == "integrator") {
+        // name [max-move max-substeps tolerance]
+        string name;
+        lineStream >> name;
+        auto &integrator = fSystem->integrator;
+        if (name == "trapezoid") {
+          integrator.type = INTEGRATOR_TRAPEZOID;
+        } else if (name == "euler") {
+          integrator.type = INTEGRATOR_EULER;
+        } else if (name == "verlet") {
+          integrator.type = INTEGRATOR_VERLET;
+        } else if (name == "adaptive") {
+          integrator.type = INTEGRATOR_ADAPTIVE;
+        } else {
+          LOG(FATAL) << "Unknow integrator " << name;
+        }
+        double maxMove, tolerance;
+        int maxSubsteps;
+        if (lineStream >> maxMove) {
+          integrator.maxMove = maxMove;
+        }
+        if (lineStream >> maxSubsteps) {
+          integrator.maxSubsteps = maxSubsteps;
+        }
+        if (lineStream >> tolerance) {
+          integrator.tolerance = tolerance;
+        }
       } else if (token == "object") {
         string type;
         shared_ptr<Object> newObj = make_shared<Object>();
@@ -77,33 +116,59 @@ public:
 
         if (type == "barrier") {
           newObj->type = OBJ_BARRIER;
+          newObj->kind = fSystem->addKind(OBJ_BARRIER);
         } else if (type == "food") {
           newObj->type = OBJ_FOOD;
+          newObj->kind = fSystem->addKind(OBJ_FOOD);
         } else if (type == "group") {
           newObj->type = OBJ_GROUP;
           int number;
-          newObj->forces = make_shared<Forces>();
+          Forces forces{};
 
-          lineStream >> number >> newObj->forces->food >>
-              newObj->forces->barrier >> newObj->forces->group >>
-              newObj->forces->repulsion;
+          lineStream >> number >> forces.food >> forces.barrier >>
+              forces.group >> forces.repulsion;
+          // the members fill a ball around pos at least spacing apart,
+          // three radii unless given
+          double spacing = 3 * newObj->radius, given;
+          if (lineStream >> given) {
+            spacing = given;
+          }
+          if (number < 1 || !(spacing > 0)) {
+            LOG(ERROR) << "Bad group line: " << line;
+            return false;
+          }
+          newObj->kind = fSystem->addKind(OBJ_GROUP, forces);
 
           newObj->calFrame();
           newObj->modelID = loadObjFromFile(objFile, scalar);
-          fSystem->objects.emplace_back(newObj);
+          // keyed by the index of the first member, not by the draws made
+          // before
+          Philox random =
+              fSystem->random(STREAM_SPAWN, fSystem->objects.size());
+          fSystem->spawn(newObj);
+          vector<vec3> placed;
+          // a ball of number points at the density of a full sample is
+          // 1.4 cbrt(number) spacings across, a bigger box is only tried if
+          // it does not fit
+          for (double side = 1.8 * spacing * cbrt((double)number);
+               (int)placed.size() < number; side *= 2) {
+            vec3 lo, hi;
+            for (int k = 0; k < 3; ++k) {
+              lo[k] = newObj->pos[k] - side / 2;
+              hi[k] = newObj->pos[k] + side / 2;
+            }
+            placed = PoissonDisk::sample(lo, hi, spacing, newObj->pos, number,
+                                         [&] { return random.uniform(); });
+            if (placed.empty()) {
+              LOG(ERROR) << "Cannot place a group of " << number;
+              return false;
+            }
+          }
           for (int i = 1; i < number; ++i) {
             shared_ptr<Object> tObj = make_shared<Object>(*newObj);
-            tObj->forces = make_shared<Forces>(*newObj->forces);
-
-            for (int j = 0; j < 3; ++j) {
-              int sign = 1;
-              if (rand() % 2) {
-                sign = -1;
-              }
-              tObj->pos[j] += i * newObj->radius * sign;
-            }
+            tObj->pos = placed[i];
             tObj->calFrame();
-            fSystem->objects.emplace_back(tObj);
+            fSystem->spawn(tObj);
           }
         } else {
           LOG(FATAL) << "Unknow type for object " << type;
@@ -111,7 +176,134 @@ public:
         if (type != "group") {
           newObj->calFrame();
           newObj->modelID = loadObjFromFile(objFile, scalar);
-          fSystem->objects.emplace_back(newObj);
+          fSystem->spawn(newObj);
+        }
+      } else if (token == "obstacle") {
+        // a barrier of any shape: filename scalar px py pz
+        shared_ptr<Object> newObj = make_shared<Object>();
+        string objFile;
+        double scalar;
+        lineStream >> objFile >> scalar >> newObj->pos[0] >> newObj->pos[1] >>
+            newObj->pos[2];
+        auto shape = make_shared<vector<Triangle>>();
+        if (!loadTrianglesFromFile(objFile, scalar, newObj->pos, *shape)) {
+          return false;
+        }
+        // without a field the obstacle pushes as its bounding sphere
+        newObj->radius = 0;
+        for (const auto &t : *shape) {
+          for (const auto *v : {&t.a, &t.b, &t.c}) {
+            double d2 = 0;
+            for (int k = 0; k < 3; ++k) {
+              d2 += ((*v)[k] - newObj->pos[k]) * ((*v)[k] - newObj->pos[k]);
+            }
+            newObj->radius = max(newObj->radius, sqrt(d2));
+          }
+        }
+        newObj->shape = shape;
+        newObj->type = OBJ_BARRIER;
+        newObj->kind = fSystem->addKind(OBJ_BARRIER);
+        newObj->calFrame();
+        newObj->modelID = loadObjFromFile(objFile, scalar);
+        fSystem->spawn(newObj);
+      } else if (token == "field") {
+        // cell margin [cache-file]
+        if (!(lineStream >> fieldCell >> fieldMargin) || fieldCell <= 0) {
+          LOG(ERROR) << "Bad field line: " << line;
+          return false;
+        }
+        lineStream >> fieldCache;
+      } else if (token == "force") {
+        // target source scale power [near far far-radius], - is unbounded
+        // power is 1 for 1/d or 3 for 1/d^3
+        int target, source;
+        ForceTerm term;
+        auto bound = [](const string &token, double unbounded, double &value) {
+          istringstream boundStream(token);
+          value = unbounded;
+          return token == "-" || bool(boundStream >> value);
+        };
+        string near, far;
+        bool ok = bool(lineStream >> target >> source >> term.scale >>
+                       term.power);
+        if (ok && lineStream >> near >> far) {
+          ok = bound(near, -HUGE_VAL, term.near) &&
+               bound(far, HUGE_VAL, term.far);
+          lineStream >> term.farRadius;
+        }
+        // the kernels only know the inverse and the inverse cube
+        if (!ok || (term.power != 1 && term.power != 3)) {
+          LOG(ERROR) << "Bad force line: " << line;
+          return false;
+        }
+        overrides.push_back({target, source, term});
+      }
+    }
+    // a force line replaces the default terms of its pair of kinds
+    fSystem->defaultInteractions();
+    int kinds = fSystem->kinds.size();
+    set<pair<int, int>> replaced;
+    for (const auto &entry : overrides) {
+      if (entry.target < 0 || entry.target >= kinds || entry.source < 0 ||
+          entry.source >= kinds) {
+        LOG(ERROR) << "Force between unknown kinds " << entry.target << " "
+                   << entry.source;
+        return false;
+      }
+      auto &terms = fSystem->interactions[entry.target][entry.source].terms;
+      if (replaced.insert({entry.target, entry.source}).second) {
+        terms.clear();
+      }
+      terms.emplace_back(entry.term);
+    }
+    if (fieldCell > 0 &&
+        !fSystem->bakeField(fieldCell, fieldMargin, fieldCache)) {
+      LOG(ERROR) << "Cannot bake the barriers of " << fileName;
+      return false;
+    }
+    return true;
+  }
+
+  // triangles of an OBJ file scaled and moved to offset, polygons are split
+  // into fans
+  static bool loadTrianglesFromFile(const string &fileName,
+                                    const double scalar, const vec3 &offset,
+                                    vector<Triangle> &triangles) {
+    ifstream objFile(fileName, ios::in | ios::binary);
+    if (not objFile.is_open()) {
+      LOG(ERROR) << "Cannot open obj file: " << fileName;
+      return false;
+    }
+    vector<vec3> points;
+    string line;
+    while (getline(objFile, line)) {
+      istringstream lineStream(line);
+      string token;
+      lineStream >> token;
+      if (token == "v") {
+        vec3 point;
+        lineStream >> point[0] >> point[1] >> point[2];
+        for (int k = 0; k < 3; ++k) {
+          point[k] = point[k] * scalar + offset[k];
+        }
+        points.emplace_back(point);
+      } else if (token == "f") {
+        vector<int> face;
+        while (lineStream >> token) {
+          istringstream tokenStream(token);
+          int index;
+          tokenStream >> index;
+          // negative indices count back from the last vertex
+          index = index < 0 ? points.size() + index : index - 1;
+          if (index < 0 || index >= (int)points.size()) {
+            LOG(ERROR) << "Bad face in obj file: " << fileName;
+            return false;
+          }
+          face.emplace_back(index);
+        }
+        for (size_t i = 2; i < face.size(); ++i) {
+          triangles.push_back(
+              {points[face[0]], points[face[i - 1]], points[face[i]]});
         }
       }
     }
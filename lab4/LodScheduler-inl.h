@@ -0,0 +1,95 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace ICG {
+
+// Time-sliced force updates of the agents. An agent within near of the
+// viewer or of food has its force recomputed every frame, one farther away
+// every 2nd, 4th or 8th frame as the distance doubles. In between it keeps
+// the force of its last update and still moves every frame, so its path is
+// extrapolated rather than frozen and nothing jumps when it is updated or
+// changes tier. An agent of period p updates on the frames where frame plus
+// its phase is a multiple of p, which spreads every tier evenly over its
+// period. With a budget the tier edges shrink until the agents updated per
+// frame fit in it, so the cost of a frame stops growing with the flock
+// until the flock is 8 times the budget.
+class LodScheduler {
+public:
+  typedef array<double, 3> point;
+  static const int kTiers = 4;
+
+  // 0 updates every agent every frame
+  double near{0};
+  // agents updated per frame on average, 0 is unbounded
+  int budget{0};
+  // set by FrameSystem::step while the schedule applies
+  bool active{false};
+  // radius of tier 0 of the last schedule, near or less to fit the budget
+  double edge{0};
+  // agents whose force is recomputed this frame
+  vector<int> due;
+
+  static int tierOf(double dis, double edge) {
+    int tier = 0;
+    for (; tier < kTiers - 1 && dis >= edge; edge *= 2) {
+      tier++;
+    }
+    return tier;
+  }
+
+  // targets are the spheres whose surroundings are worth every frame
+  void schedule(int frame, const vector<int> &agents, const vector<point> &pos,
+                const vector<int> &phase,
+                const vector<pair<point, double>> &targets) {
+    dis.resize(agents.size());
+    for (size_t g = 0; g < agents.size(); ++g) {
+      const auto &p = pos[agents[g]];
+      dis[g] = HUGE_VAL;
+      for (const auto &target : targets) {
+        double d2 = 0;
+        for (int k = 0; k < 3; ++k) {
+          d2 += (p[k] - target.first[k]) * (p[k] - target.first[k]);
+        }
+        dis[g] = min(dis[g], sqrt(d2) - target.second);
+      }
+    }
+    edge = near;
+    if (budget > 0 && load(near) > budget) {
+      // the load only grows with the edge, bisect for the largest that fits
+      double lo = 0, hi = near;
+      for (int it = 0; it < 20; ++it) {
+        double mid = (lo + hi) / 2;
+        (load(mid) > budget ? hi : lo) = mid;
+      }
+      edge = lo;
+    }
+    due.clear();
+    for (size_t g = 0; g < agents.size(); ++g) {
+      int i = agents[g];
+      if ((frame + phase[i]) % (1 << tierOf(dis[g], edge)) == 0) {
+        due.emplace_back(i);
+      }
+    }
+  }
+
+private:
+  // distance of every agent to the closest target
+  vector<double> dis;
+
+  // agents updated per frame on average with tier 0 out to edge
+  double load(double edge) const {
+    double sum = 0;
+    for (double d : dis) {
+      sum += 1.0 / (1 << tierOf(d, edge));
+    }
+    return sum;
+  }
+};
+
+} // namespace ICG
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+using namespace std;
+
+namespace ICG {
+
+// Verlet lists of the short-range terms. Every agent keeps the members of
+// each source kind whose centers were within the reach of the pair plus
+// skin when the lists were built. Until some object has moved more than
+// half the skin since then, a body now within reach was within reach +
+// skin at the build, so the lists stay complete and the frames in between
+// skip the hash altogether.
+class NeighborList {
+public:
+  typedef array<double, 3> point;
+
+  double skin{1};
+  // near[i * kinds + b] are the members of kind b around object i
+  vector<vector<int>> near;
+  int kinds{0};
+  // centers at the last build
+  vector<point> anchor;
+
+  void reset(int count, int kindCount) {
+    kinds = kindCount;
+    near.assign((size_t)count * kinds, vector<int>());
+    anchor.clear();
+  }
+
+  vector<int> &of(int id, int kind) { return near[(size_t)id * kinds + kind]; }
+  const vector<int> &of(int id, int kind) const {
+    return near[(size_t)id * kinds + kind];
+  }
+
+  // some object moved more than half the skin since the last build
+  bool stale(const vector<point> &pos) const {
+    if (anchor.size() != pos.size()) {
+      return true;
+    }
+    double limit = skin * skin / 4;
+    for (size_t i = 0; i < pos.size(); ++i) {
+      double d2 = 0;
+      for (int k = 0; k < 3; ++k) {
+        d2 += (pos[i][k] - anchor[i][k]) * (pos[i][k] - anchor[i][k]);
+      }
+      if (d2 > limit) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+} // namespace ICG
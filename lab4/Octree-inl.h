@@ -0,0 +1,210 @@
+#pragma once
+
+#include "SystemDS.h"
+#include "PairKernel-inl.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+
+namespace ICG {
+
+// force scale / dis^power toward a body, counted only while dis > cutoff
+struct InverseLaw {
+  double scale;
+  int power;
+  double cutoff{-HUGE_VAL};
+
+  double operator()(double dis) const {
+    return power == 1 ? scale / dis : scale / (dis * dis * dis);
+  }
+};
+
+// Barnes-Hut octree over the centers of a set of objects. Every node keeps
+// the count, mean center and mean radius of its members, so a node that
+// looks smaller than theta times its distance acts as one body at its mean
+// center. A node entirely within the cutoff of a law is skipped, one
+// entirely beyond it may be approximated, the rest are opened. theta = 0
+// opens every node and sums every pair exactly. Members are stored in tree
+// order so a leaf reads contiguous arrays.
+class Octree {
+public:
+  struct Node {
+    // bounds of the member centers
+    vec3 lo, hi;
+    vec3 center;
+    double radius, minRadius, maxRadius;
+    // members are [begin, begin + count)
+    int begin, count;
+    // children are [first, first + children), a leaf has none
+    int first{0}, children{0};
+  };
+
+  vector<Node> nodes;
+  vector<double> x, y, z, r;
+  vector<int> id;
+
+  // members are indices into pos and radius
+  void build(const vector<double> &radius, const vector<vec3> &pos,
+             const vector<int> &members) {
+    int n = members.size();
+    nodes.clear();
+    x.resize(n), y.resize(n), z.resize(n), r.resize(n);
+    id = members;
+    if (n == 0) {
+      return;
+    }
+    for (int i = 0; i < n; ++i) {
+      const auto &p = pos[members[i]];
+      x[i] = p[0], y[i] = p[1], z[i] = p[2];
+      r[i] = radius[members[i]];
+    }
+    nodes.emplace_back();
+    buildNode(0, 0, n, 0);
+  }
+
+  // sum of law toward every member other than self, seen from an object
+  // at p with radius rp
+  vec3 field(const vec3 &p, double rp, int self, double theta,
+             const InverseLaw &law) const {
+    vec3 f{0, 0, 0};
+    if (nodes.empty()) {
+      return f;
+    }
+    // opened leaves, summed after the walk
+    thread_local vector<PairKernel::Run> runs;
+    runs.clear();
+    int stack[kMaxDepth * 8 + 1], top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+      const Node &node = nodes[stack[--top]];
+      double near2 = 0, far2 = 0, d2 = 0, size = 0;
+      for (int k = 0; k < 3; ++k) {
+        double e = max({node.lo[k] - p[k], 0.0, p[k] - node.hi[k]});
+        double g = max(p[k] - node.lo[k], node.hi[k] - p[k]);
+        double c = node.center[k] - p[k];
+        near2 += e * e;
+        far2 += g * g;
+        d2 += c * c;
+        size = max(size, node.hi[k] - node.lo[k]);
+      }
+      // no member is beyond the cutoff
+      if (sqrt(far2) - rp - node.minRadius <= law.cutoff) {
+        continue;
+      }
+      bool beyond = sqrt(near2) - rp - node.maxRadius > law.cutoff;
+      if (beyond && size < theta * sqrt(d2)) {
+        double w = node.count * law(sqrt(d2) - rp - node.radius);
+        for (int k = 0; k < 3; ++k) {
+          f[k] += (node.center[k] - p[k]) * w;
+        }
+        continue;
+      }
+      if (node.children > 0) {
+        for (int c = 0; c < node.children; ++c) {
+          stack[top++] = node.first + c;
+        }
+        continue;
+      }
+      // leaves next to each other in tree order are summed as one run
+      int end = node.begin + node.count;
+      if (!runs.empty() && runs.back().second == node.begin) {
+        runs.back().second = end;
+      } else if (!runs.empty() && runs.back().first == end) {
+        runs.back().first = node.begin;
+      } else {
+        runs.emplace_back(node.begin, end);
+      }
+    }
+    PairKernel::accumulate(p, rp, self, x.data(), y.data(), z.data(),
+                           r.data(), id.data(), runs.data(), runs.size(),
+                           ForceTerm{law.scale, law.power, law.cutoff}, f);
+    return f;
+  }
+
+private:
+  static const int kLeafSize = 8;
+  // coincident centers stop splitting here
+  static const int kMaxDepth = 32;
+
+  void buildNode(int index, int begin, int end, int depth) {
+    Node node;
+    node.begin = begin;
+    node.count = end - begin;
+    node.lo = {HUGE_VAL, HUGE_VAL, HUGE_VAL};
+    node.hi = {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+    node.center = {0, 0, 0};
+    node.radius = 0;
+    node.minRadius = HUGE_VAL;
+    node.maxRadius = 0;
+    for (int i = begin; i < end; ++i) {
+      double q[3] = {x[i], y[i], z[i]};
+      for (int k = 0; k < 3; ++k) {
+        node.lo[k] = min(node.lo[k], q[k]);
+        node.hi[k] = max(node.hi[k], q[k]);
+        node.center[k] += q[k];
+      }
+      node.radius += r[i];
+      node.minRadius = min(node.minRadius, r[i]);
+      node.maxRadius = max(node.maxRadius, r[i]);
+    }
+    for (int k = 0; k < 3; ++k) {
+      node.center[k] /= node.count;
+    }
+    node.radius /= node.count;
+    nodes[index] = node;
+    if (node.count <= kLeafSize || depth >= kMaxDepth) {
+      return;
+    }
+
+    // counting sort of the members into the octants around the box center
+    vec3 mid;
+    for (int k = 0; k < 3; ++k) {
+      mid[k] = (node.lo[k] + node.hi[k]) / 2;
+    }
+    auto octant = [&](int i) {
+      return (x[i] > mid[0]) | (y[i] > mid[1]) << 1 | (z[i] > mid[2]) << 2;
+    };
+    int start[9] = {};
+    for (int i = begin; i < end; ++i) {
+      start[octant(i) + 1]++;
+    }
+    for (int o = 0; o < 8; ++o) {
+      start[o + 1] += start[o];
+    }
+    int slot[8];
+    copy(start, start + 8, slot);
+    int n = end - begin;
+    vector<double> sx(n), sy(n), sz(n), sr(n);
+    vector<int> sid(n);
+    for (int i = begin; i < end; ++i) {
+      int to = slot[octant(i)]++;
+      sx[to] = x[i], sy[to] = y[i], sz[to] = z[i], sr[to] = r[i];
+      sid[to] = id[i];
+    }
+    copy(sx.begin(), sx.end(), x.begin() + begin);
+    copy(sy.begin(), sy.end(), y.begin() + begin);
+    copy(sz.begin(), sz.end(), z.begin() + begin);
+    copy(sr.begin(), sr.end(), r.begin() + begin);
+    copy(sid.begin(), sid.end(), id.begin() + begin);
+
+    // children of one node are stored next to each other
+    int first = nodes.size(), children = 0;
+    for (int o = 0; o < 8; ++o) {
+      children += start[o + 1] > start[o];
+    }
+    nodes.resize(first + children);
+    nodes[index].first = first;
+    nodes[index].children = children;
+    int child = first;
+    for (int o = 0; o < 8; ++o) {
+      if (start[o + 1] > start[o]) {
+        buildNode(child++, begin + start[o], begin + start[o + 1], depth + 1);
+      }
+    }
+  }
+};
+
+} // namespace ICG
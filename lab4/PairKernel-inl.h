@@ -0,0 +1,225 @@
+#pragma once
+
+#include "SystemDS.h"
+
+#include <cmath>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ICG_PAIRKERNEL_AVX2 1
+#endif
+
+using namespace std;
+
+namespace ICG {
+
+// Bodies pushing an agent, in separate coordinate arrays so the kernel
+// loads kLanes of them at once.
+struct PairBatch {
+  vector<double> x, y, z, r;
+  vector<int> id;
+
+  void clear() {
+    x.clear(), y.clear(), z.clear(), r.clear();
+    id.clear();
+  }
+  void push(const vec3 &p, double radius, int j) {
+    x.push_back(p[0]), y.push_back(p[1]), z.push_back(p[2]);
+    r.push_back(radius);
+    id.push_back(j);
+  }
+  int size() const { return id.size(); }
+};
+
+// Sum of one force term over runs of bodies, seen from an agent. The
+// scalar loop is the reference. The AVX2 one takes kLanes bodies per
+// iteration: offsets stay in double, the float rsqrt estimate gets one
+// Newton step in float and one in double so the gap between the surfaces
+// keeps the precision of the centers, then the law runs in float from an
+// rcp estimate refined by one Newton step. A pair reads within about 1e-6
+// of the scalar force. Runs are passed together so the short runs of tree
+// leaves share one call. The AVX2 and FMA loop is picked at runtime.
+class PairKernel {
+public:
+  static const int kLanes = 8;
+  // [first, second) of the arrays
+  typedef pair<int, int> Run;
+
+  static void accumulate(const vec3 &p, double rp, int self, const double *x,
+                         const double *y, const double *z, const double *r,
+                         const int *id, const Run *runs, int count,
+                         const ForceTerm &term, vec3 &f) {
+#ifdef ICG_PAIRKERNEL_AVX2
+    static const bool avx2 =
+        __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if (avx2) {
+      accumulateAVX2(p, rp, self, x, y, z, r, id, runs, count, term, f);
+      return;
+    }
+#endif
+    accumulateScalar(p, rp, self, x, y, z, r, id, runs, count, term, f);
+  }
+
+  static void accumulate(const vec3 &p, double rp, int self,
+                         const PairBatch &batch, const ForceTerm &term,
+                         vec3 &f) {
+    Run all{0, batch.size()};
+    accumulate(p, rp, self, batch.x.data(), batch.y.data(), batch.z.data(),
+               batch.r.data(), batch.id.data(), &all, 1, term, f);
+  }
+
+  static void accumulateScalar(const vec3 &p, double rp, int self,
+                               const double *x, const double *y,
+                               const double *z, const double *r,
+                               const int *id, const Run *runs, int count,
+                               const ForceTerm &term, vec3 &f) {
+    for (int k = 0; k < count; ++k) {
+      for (int i = runs[k].first; i < runs[k].second; ++i) {
+        double dx = x[i] - p[0], dy = y[i] - p[1], dz = z[i] - p[2];
+        double dis = sqrt(dx * dx + dy * dy + dz * dz) - rp - r[i];
+        if (id[i] == self || dis <= term.near ||
+            dis >= term.far + term.farRadius * r[i]) {
+          continue;
+        }
+        double w = term.power == 1 ? term.scale / dis
+                                   : term.scale / (dis * dis * dis);
+        f[0] += dx * w, f[1] += dy * w, f[2] += dz * w;
+      }
+    }
+  }
+
+private:
+#ifdef ICG_PAIRKERNEL_AVX2
+  // offsets of four bodies from the agent
+  struct Half {
+    __m256d dx, dy, dz, d2, r;
+  };
+
+  // inside marks the lanes to read unless all are, the rest read as zero
+  template <bool full>
+  __attribute__((target("avx2,fma"), always_inline)) static __m256d
+  read(const double *a, __m256i inside) {
+    return full ? _mm256_loadu_pd(a) : _mm256_maskload_pd(a, inside);
+  }
+
+  template <bool full>
+  __attribute__((target("avx2,fma"), always_inline)) static Half
+  load(const vec3 &p, const double *x, const double *y, const double *z,
+       const double *r, __m256i inside) {
+    Half h;
+    h.dx = _mm256_sub_pd(read<full>(x, inside), _mm256_set1_pd(p[0]));
+    h.dy = _mm256_sub_pd(read<full>(y, inside), _mm256_set1_pd(p[1]));
+    h.dz = _mm256_sub_pd(read<full>(z, inside), _mm256_set1_pd(p[2]));
+    h.r = read<full>(r, inside);
+    h.d2 = _mm256_fmadd_pd(
+        h.dz, h.dz,
+        _mm256_fmadd_pd(h.dy, h.dy, _mm256_mul_pd(h.dx, h.dx)));
+    return h;
+  }
+
+  __attribute__((target("avx2,fma"), always_inline)) static __m256
+  narrow(__m256d lo, __m256d hi) {
+    return _mm256_set_m128(_mm256_cvtpd_ps(hi), _mm256_cvtpd_ps(lo));
+  }
+
+  __attribute__((target("avx2,fma"), always_inline)) static __m256d
+  gap(const Half &h, __m128 guess, __m256d rp) {
+    __m256d y = _mm256_cvtps_pd(guess);
+    y = _mm256_mul_pd(
+        _mm256_mul_pd(_mm256_set1_pd(0.5), y),
+        _mm256_fnmadd_pd(h.d2, _mm256_mul_pd(y, y), _mm256_set1_pd(3)));
+    return _mm256_fmsub_pd(h.d2, y, _mm256_add_pd(rp, h.r));
+  }
+
+  __attribute__((target("avx2,fma"), always_inline)) static void
+  add(const Half &h, __m256d w, __m256d &fx, __m256d &fy, __m256d &fz) {
+    fx = _mm256_fmadd_pd(h.dx, w, fx);
+    fy = _mm256_fmadd_pd(h.dy, w, fy);
+    fz = _mm256_fmadd_pd(h.dz, w, fz);
+  }
+
+  // adds the lanes of inside, eight 32 bit masks, other than self
+  template <bool full>
+  __attribute__((target("avx2,fma"), always_inline)) static void
+  push(const vec3 &p, int self, const double *x, const double *y,
+       const double *z, const double *r, const int *id, __m256i inside,
+       __m256d rp, const ForceTerm &term, __m256d &fx, __m256d &fy,
+       __m256d &fz) {
+    __m256i ids =
+        full ? _mm256_loadu_si256(reinterpret_cast<const __m256i *>(id))
+             : _mm256_maskload_epi32(id, inside);
+    __m256 valid = _mm256_castsi256_ps(_mm256_andnot_si256(
+        _mm256_cmpeq_epi32(ids, _mm256_set1_epi32(self)), inside));
+    Half lo = load<full>(p, x, y, z, r,
+                   _mm256_cvtepi32_epi64(_mm256_castsi256_si128(inside)));
+    Half hi = load<full>(p, x + 4, y + 4, z + 4, r + 4,
+                   _mm256_cvtepi32_epi64(_mm256_extracti128_si256(inside, 1)));
+    // 1 / sqrt(d2) refined by y (3 - d2 y^2) / 2 once in float and once
+    // in double, so the gap keeps the precision of the centers. Coincident
+    // centers get a finite 1 / sqrt and a zero distance.
+    __m256d tiny = _mm256_set1_pd(1e-30);
+    lo.d2 = _mm256_max_pd(lo.d2, tiny);
+    hi.d2 = _mm256_max_pd(hi.d2, tiny);
+    __m256 d2 = narrow(lo.d2, hi.d2);
+    __m256 est = _mm256_rsqrt_ps(d2);
+    est = _mm256_mul_ps(
+        _mm256_mul_ps(_mm256_set1_ps(0.5f), est),
+        _mm256_fnmadd_ps(d2, _mm256_mul_ps(est, est), _mm256_set1_ps(3)));
+    __m256 dis = narrow(gap(lo, _mm256_castps256_ps128(est), rp),
+                        gap(hi, _mm256_extractf128_ps(est, 1), rp));
+    __m256 radius = narrow(lo.r, hi.r);
+    // 1 / dis refined by y (2 - dis y)
+    __m256 inv = _mm256_rcp_ps(dis);
+    inv = _mm256_mul_ps(inv, _mm256_fnmadd_ps(dis, inv, _mm256_set1_ps(2)));
+    if (term.power != 1) {
+      inv = _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv));
+    }
+    __m256 far = _mm256_fmadd_ps(_mm256_set1_ps(term.farRadius), radius,
+                                 _mm256_set1_ps(term.far));
+    __m256 act = _mm256_and_ps(
+        valid,
+        _mm256_and_ps(
+            _mm256_cmp_ps(dis, _mm256_set1_ps(term.near), _CMP_GT_OQ),
+            _mm256_cmp_ps(dis, far, _CMP_LT_OQ)));
+    __m256 w =
+        _mm256_and_ps(act, _mm256_mul_ps(_mm256_set1_ps(term.scale), inv));
+    add(lo, _mm256_cvtps_pd(_mm256_castps256_ps128(w)), fx, fy, fz);
+    add(hi, _mm256_cvtps_pd(_mm256_extractf128_ps(w, 1)), fx, fy, fz);
+  }
+
+  __attribute__((target("avx2,fma"), always_inline)) static double
+  sum(__m256d v) {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v),
+                           _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+  }
+
+  __attribute__((target("avx2,fma"))) static void
+  accumulateAVX2(const vec3 &p, double rp, int self, const double *x,
+                 const double *y, const double *z, const double *r,
+                 const int *id, const Run *runs, int count,
+                 const ForceTerm &term, vec3 &f) {
+    __m256d fx = _mm256_setzero_pd(), fy = fx, fz = fx;
+    __m256d rp4 = _mm256_set1_pd(rp);
+    __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i all = _mm256_set1_epi32(-1);
+    for (int k = 0; k < count; ++k) {
+      int i = runs[k].first, end = runs[k].second;
+      for (; i + kLanes <= end; i += kLanes) {
+        push<true>(p, self, x + i, y + i, z + i, r + i, id + i, all, rp4,
+                   term, fx, fy, fz);
+      }
+      if (i < end) {
+        __m256i inside =
+            _mm256_cmpgt_epi32(_mm256_set1_epi32(end - i), index);
+        push<false>(p, self, x + i, y + i, z + i, r + i, id + i, inside, rp4,
+                    term, fx, fy, fz);
+      }
+    }
+    f[0] += sum(fx), f[1] += sum(fy), f[2] += sum(fz);
+  }
+#endif
+};
+
+} // namespace ICG
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+using namespace std;
+
+namespace ICG {
+
+// what a draw is for, so two uses never share a sequence
+enum RandomStream {
+  STREAM_SPAWN = 0
+};
+
+// Counter-based generator, Philox-4x32-10 of Salmon et al. A draw is a pure
+// function of the scene seed, the stream, the entity it is for and how many
+// draws that entity made before, with no state shared between entities. So
+// entities can draw in any order or on any thread and still get the same
+// numbers on every run, and a snapshot only needs the seed.
+class Philox {
+public:
+  typedef array<uint32_t, 4> block;
+
+  Philox(uint64_t seed, RandomStream stream, uint32_t entity)
+      : key{{uint32_t(seed), uint32_t(seed >> 32)}},
+        counter{{0, entity, uint32_t(stream), 0}} {}
+
+  uint32_t next() {
+    if (used == 4) {
+      out = generate(counter, key);
+      counter[0]++;
+      used = 0;
+    }
+    return out[used++];
+  }
+
+  // uniform in [0, 1) with 53 random bits
+  double uniform() {
+    uint64_t high = next() >> 5, low = next() >> 6;
+    return (high * 67108864.0 + low) / 9007199254740992.0;
+  }
+
+  static block generate(block c, array<uint32_t, 2> k) {
+    for (int round = 0; round < 10; ++round) {
+      uint64_t p0 = uint64_t(0xD2511F53) * c[0];
+      uint64_t p1 = uint64_t(0xCD9E8D57) * c[2];
+      c = {{uint32_t(p1 >> 32) ^ c[1] ^ k[0], uint32_t(p1),
+            uint32_t(p0 >> 32) ^ c[3] ^ k[1], uint32_t(p0)}};
+      k[0] += 0x9E3779B9;
+      k[1] += 0xBB67AE85;
+    }
+    return c;
+  }
+
+private:
+  array<uint32_t, 2> key;
+  block counter;
+  block out{};
+  int used{4};
+};
+
+} // namespace ICG
@@ -0,0 +1,231 @@
+#pragma once
+
+#include "SpatialHash-inl.h"
+#include "SystemDS.h"
+#include "ThreadPool-inl.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+
+namespace ICG {
+
+struct Ray {
+  vec3 origin;
+  // need not be normalized
+  vec3 dir;
+  double maxT{HUGE_VAL};
+};
+
+struct RayHit {
+  // -1 if nothing was hit
+  int id{-1};
+  // distance along the normalized ray
+  double t{0};
+  // where the ray or the center of the cast sphere stops
+  vec3 point;
+  // surface normal of the hit body at the contact
+  vec3 normal;
+};
+
+// Ray, sphere-cast and overlap queries against the bodies of a FrameSystem,
+// read from the SpatialHash that indexes their centers. Its cells are twice
+// the largest radius and [lo, hi] bounds every center. A cast walks the
+// cells along the ray in order, looking up only the slab of neighbor cells
+// each step adds, and stops at the first cell past the nearest hit instead
+// of touching every body. The queries are const and can run on many threads
+// at once.
+class WorldQuery {
+public:
+  WorldQuery(const SpatialHash &hash,
+             const vector<shared_ptr<Object>> &objects, const vec3 &lo,
+             const vec3 &hi)
+      : hash(hash), objects(objects), maxRadius(hash.cellSize / 2), lo(lo),
+        hi(hi) {}
+
+  bool raycast(const Ray &ray, RayHit &hit) const {
+    return sphereCast(ray, 0, hit);
+  }
+
+  // sweep a sphere of radius along the ray, hit.point is its center at the
+  // first contact
+  bool sphereCast(const Ray &ray, double radius, RayHit &hit) const {
+    hit = RayHit();
+    double len = sqrt(ray.dir[0] * ray.dir[0] + ray.dir[1] * ray.dir[1] +
+                      ray.dir[2] * ray.dir[2]);
+    if (objects.empty() || len == 0) {
+      return false;
+    }
+    vec3 dir;
+    for (int k = 0; k < 3; ++k) {
+      dir[k] = ray.dir[k] / len;
+    }
+    // only the part of the ray inside the bounds of all bodies matters
+    double reach = maxRadius + radius, t0 = 0, t1 = ray.maxT;
+    for (int k = 0; k < 3; ++k) {
+      double a = lo[k] - reach, b = hi[k] + reach;
+      if (dir[k] == 0) {
+        if (ray.origin[k] < a || ray.origin[k] > b) {
+          return false;
+        }
+        continue;
+      }
+      double ta = (a - ray.origin[k]) / dir[k],
+             tb = (b - ray.origin[k]) / dir[k];
+      t0 = max(t0, min(ta, tb));
+      t1 = min(t1, max(ta, tb));
+    }
+    if (t0 > t1) {
+      return false;
+    }
+
+    // 3D DDA from Amanatides and Woo
+    double size = hash.cellSize;
+    SpatialHash::point start;
+    for (int k = 0; k < 3; ++k) {
+      start[k] = ray.origin[k] + dir[k] * t0;
+    }
+    auto cell = hash.cellOf(start);
+    int step[3];
+    double tMax[3], tDelta[3];
+    for (int k = 0; k < 3; ++k) {
+      step[k] = dir[k] > 0 ? 1 : (dir[k] < 0 ? -1 : 0);
+      double edge = (cell[k] + (step[k] > 0)) * size;
+      tMax[k] = step[k] ? t0 + (edge - start[k]) / dir[k] : HUGE_VAL;
+      tDelta[k] = step[k] ? size / abs(dir[k]) : HUGE_VAL;
+    }
+    // a body touching the ray inside a cell has its center this many cells
+    // away at most
+    int range = ceil(reach / size);
+    double best = t1;
+    auto visit = [&](const array<int, 3> &from, const array<int, 3> &to) {
+      for (int x = from[0]; x <= to[0]; ++x) {
+        for (int y = from[1]; y <= to[1]; ++y) {
+          for (int z = from[2]; z <= to[2]; ++z) {
+            auto it = hash.cells.find(SpatialHash::key(x, y, z));
+            if (it == hash.cells.end()) {
+              continue;
+            }
+            for (int id : it->second) {
+              double t;
+              if (intersect(ray.origin, dir, id, radius, t) && t <= best) {
+                best = t;
+                hit.id = id;
+              }
+            }
+          }
+        }
+      }
+    };
+    array<int, 3> from, to;
+    for (int k = 0; k < 3; ++k) {
+      from[k] = cell[k] - range;
+      to[k] = cell[k] + range;
+    }
+    visit(from, to);
+    while (true) {
+      // every closer hit lies around a cell we have visited
+      double exit = min({tMax[0], tMax[1], tMax[2]});
+      if (best <= exit || exit > t1) {
+        break;
+      }
+      int axis = tMax[0] == exit ? 0 : (tMax[1] == exit ? 1 : 2);
+      cell[axis] += step[axis];
+      tMax[axis] += tDelta[axis];
+      from[axis] += step[axis];
+      to[axis] += step[axis];
+      // the cells around the new one that the old block did not cover
+      auto slabFrom = from, slabTo = to;
+      if (step[axis] > 0) {
+        slabFrom[axis] = to[axis];
+      } else {
+        slabTo[axis] = from[axis];
+      }
+      visit(slabFrom, slabTo);
+    }
+    if (hit.id < 0) {
+      return false;
+    }
+    hit.t = best;
+    const auto &center = objects[hit.id]->pos;
+    double dis = 0;
+    for (int k = 0; k < 3; ++k) {
+      hit.point[k] = ray.origin[k] + dir[k] * best;
+      hit.normal[k] = hit.point[k] - center[k];
+      dis += hit.normal[k] * hit.normal[k];
+    }
+    dis = sqrt(dis);
+    for (int k = 0; k < 3; ++k) {
+      // a ray starting inside the body points back along itself
+      hit.normal[k] = dis > 0 ? hit.normal[k] / dis : -dir[k];
+    }
+    return true;
+  }
+
+  // ids of every body closer than radius to center, sorted
+  void overlap(const vec3 &center, double radius, vector<int> &ids) const {
+    ids.clear();
+    double reach = radius + maxRadius;
+    SpatialHash::point qlo, qhi;
+    for (int k = 0; k < 3; ++k) {
+      qlo[k] = center[k] - reach;
+      qhi[k] = center[k] + reach;
+    }
+    hash.query(qlo, qhi, [&](int id) {
+      const auto &object = objects[id];
+      double dis = 0;
+      for (int k = 0; k < 3; ++k) {
+        dis += (object->pos[k] - center[k]) * (object->pos[k] - center[k]);
+      }
+      double r = radius + object->radius;
+      if (dis < r * r) {
+        ids.emplace_back(id);
+      }
+    });
+    sort(ids.begin(), ids.end());
+  }
+
+  // answer every ray at once, hits[i] belongs to rays[i]
+  void raycastBatch(const vector<Ray> &rays, vector<RayHit> &hits,
+                    ThreadPool &threads) const {
+    hits.resize(rays.size());
+    threads.parallelFor(rays.size(), 64, [&](int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        raycast(rays[i], hits[i]);
+      }
+    });
+  }
+
+private:
+  const SpatialHash &hash;
+  const vector<shared_ptr<Object>> &objects;
+  double maxRadius;
+  vec3 lo, hi;
+
+  // first t >= 0 where the ray comes within radius of body id
+  bool intersect(const vec3 &origin, const vec3 &dir, int id, double radius,
+                 double &t) const {
+    const auto &object = objects[id];
+    double r = object->radius + radius;
+    double b = 0, c = -r * r;
+    for (int k = 0; k < 3; ++k) {
+      double oc = origin[k] - object->pos[k];
+      b += oc * dir[k];
+      c += oc * oc;
+    }
+    if (c <= 0) {
+      t = 0;
+      return true;
+    }
+    double disc = b * b - c;
+    if (b > 0 || disc < 0) {
+      return false;
+    }
+    t = -b - sqrt(disc);
+    return true;
+  }
+};
+
+} // namespace ICG
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+namespace ICG {
+
+// Stable handles over a dense array. A handle names a slot and the
+// generation the slot had when it was handed out. Removing bumps the
+// generation, so a handle kept past the removal stops resolving instead of
+// reaching whatever reuses the slot. The dense array never has holes: the
+// last element moves into the place of a removed one and its slot follows
+// it, so insert and remove are O(1) and loops over the array stay packed.
+class SlotMap {
+public:
+  struct Handle {
+    int slot{-1};
+    uint32_t generation{0};
+
+    bool operator==(const Handle &other) const {
+      return slot == other.slot && generation == other.generation;
+    }
+    bool operator!=(const Handle &other) const { return !(*this == other); }
+  };
+
+  // dense index of every slot, -1 while free
+  vector<int> index;
+  vector<uint32_t> generation;
+  // slot of every dense index
+  vector<int> slotOf;
+  // free slots, the last one is reused first
+  vector<int> freeSlots;
+
+  int size() const { return slotOf.size(); }
+  int capacity() const { return index.size(); }
+
+  void clear() {
+    index.clear();
+    generation.clear();
+    slotOf.clear();
+    freeSlots.clear();
+  }
+
+  // a slot for dense index size(), the caller appends to its arrays
+  Handle insert() {
+    int slot;
+    if (freeSlots.empty()) {
+      slot = index.size();
+      index.push_back(-1);
+      generation.push_back(0);
+    } else {
+      slot = freeSlots.back();
+      freeSlots.pop_back();
+    }
+    index[slot] = slotOf.size();
+    slotOf.push_back(slot);
+    return Handle{slot, generation[slot]};
+  }
+
+  // dense index of handle, -1 once it was removed
+  int find(const Handle &handle) const {
+    if (handle.slot < 0 || handle.slot >= capacity() ||
+        generation[handle.slot] != handle.generation) {
+      return -1;
+    }
+    return index[handle.slot];
+  }
+
+  Handle handleAt(int i) const {
+    return Handle{slotOf[i], generation[slotOf[i]]};
+  }
+
+  // frees handle and moves the last element into its dense index, which is
+  // returned so the caller moves its arrays the same way, -1 if stale
+  int remove(const Handle &handle) {
+    int i = find(handle);
+    if (i < 0) {
+      return -1;
+    }
+    int last = slotOf.back();
+    slotOf[i] = last;
+    index[last] = i;
+    slotOf.pop_back();
+    index[handle.slot] = -1;
+    generation[handle.slot]++;
+    freeSlots.push_back(handle.slot);
+    return i;
+  }
+
+  // dense index s now holds the element that was at perm[s]
+  void permute(const vector<int> &perm) {
+    vector<int> moved(perm.size());
+    for (size_t s = 0; s < perm.size(); ++s) {
+      moved[s] = slotOf[perm[s]];
+      index[moved[s]] = s;
+    }
+    slotOf.swap(moved);
+  }
+};
+
+} // namespace ICG
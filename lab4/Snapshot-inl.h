@@ -0,0 +1,255 @@
+#pragma once
+
+#include "SystemDS.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <glog/logging.h>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+namespace ICG {
+
+// Binary snapshot of everything that changes while a FrameSystem steps.
+// Models, object types and force coefficients come from the .des file, so a
+// snapshot is restored into a system loaded from the same scene and then
+// continues bit-identically. An object still in the slot it was loaded into
+// keeps its model and shape, one spawned at runtime is rebuilt from the
+// prototype of its kind.
+class Snapshot {
+public:
+  static void save(const FrameSystem &fs, string &buffer) {
+    buffer.clear();
+    put(buffer, kMagic);
+    put(buffer, kVersion);
+    put(buffer, fs.frameCounter);
+    put(buffer, fs.stepSize);
+    put(buffer, fs.seed);
+    // the slot map as it is, so the restored system sums in the same order
+    // and hands out the same handles
+    const auto &slots = fs.slots;
+    put(buffer, (int32_t)slots.capacity());
+    for (int slot = 0; slot < slots.capacity(); ++slot) {
+      put(buffer, slots.generation[slot]);
+      put(buffer, (int32_t)slots.index[slot]);
+    }
+    put(buffer, (int32_t)slots.freeSlots.size());
+    for (int slot : slots.freeSlots) {
+      put(buffer, (int32_t)slot);
+    }
+    put(buffer, (int32_t)fs.objects.size());
+    for (const auto &object : fs.objects) {
+      put(buffer, (int32_t)object->kind);
+      put(buffer, object->pos);
+      put(buffer, object->v);
+      put(buffer, object->force);
+    }
+  }
+
+  static bool restore(const string &buffer, FrameSystem &fs) {
+    size_t at = 0;
+    int32_t magic, version, count;
+    if (!get(buffer, at, magic) || magic != kMagic ||
+        !get(buffer, at, version) || version != kVersion) {
+      LOG(ERROR) << "Not a snapshot of this version";
+      return false;
+    }
+    // nothing reaches fs until the whole snapshot checks out
+    int frameCounter = 0;
+    double stepSize = 0;
+    uint64_t seed = 0;
+    get(buffer, at, frameCounter);
+    get(buffer, at, stepSize);
+    get(buffer, at, seed);
+    SlotMap slots;
+    int32_t capacity, freeCount;
+    if (!get(buffer, at, capacity) || capacity < 0 ||
+        capacity > (int32_t)(buffer.size() - at) / 8) {
+      LOG(ERROR) << "Snapshot is truncated or corrupted";
+      return false;
+    }
+    slots.generation.resize(capacity);
+    slots.index.resize(capacity);
+    for (int slot = 0; slot < capacity; ++slot) {
+      get(buffer, at, slots.generation[slot]);
+      get(buffer, at, slots.index[slot]);
+    }
+    get(buffer, at, freeCount);
+    if (freeCount < 0 || freeCount > capacity) {
+      LOG(ERROR) << "Snapshot is truncated or corrupted";
+      return false;
+    }
+    slots.freeSlots.resize(freeCount);
+    for (auto &slot : slots.freeSlots) {
+      get(buffer, at, slot);
+    }
+    // every live slot holds one dense index and every free one is listed
+    // once
+    count = capacity - freeCount;
+    slots.slotOf.assign(count, -1);
+    vector<char> listed(capacity, false);
+    for (int slot : slots.freeSlots) {
+      if (slot < 0 || slot >= capacity || listed[slot] ||
+          slots.index[slot] != -1) {
+        LOG(ERROR) << "Snapshot is truncated or corrupted";
+        return false;
+      }
+      listed[slot] = true;
+    }
+    for (int slot = 0; slot < capacity; ++slot) {
+      int i = slots.index[slot];
+      if (listed[slot]) {
+        continue;
+      }
+      if (i < 0 || i >= count || slots.slotOf[i] != -1) {
+        LOG(ERROR) << "Snapshot is truncated or corrupted";
+        return false;
+      }
+      slots.slotOf[i] = slot;
+    }
+    int32_t stored;
+    if (!get(buffer, at, stored) || stored != count) {
+      LOG(ERROR) << "Snapshot is truncated or corrupted";
+      return false;
+    }
+    vector<shared_ptr<Object>> objects(count);
+    AgentState state;
+    state.resize(count);
+    for (int i = 0; i < count; ++i) {
+      int32_t kind;
+      if (!get(buffer, at, kind) || kind < 0 ||
+          kind >= (int32_t)fs.kinds.size() || !fs.kinds[kind].prototype) {
+        LOG(ERROR) << "Snapshot has an object of a kind the scene lacks";
+        return false;
+      }
+      // an object respawned into the slot since has a new generation
+      int slot = slots.slotOf[i];
+      int loaded = slot < fs.slots.capacity() &&
+                           fs.slots.generation[slot] == slots.generation[slot]
+                       ? fs.slots.index[slot]
+                       : -1;
+      if (loaded >= 0 && fs.objects[loaded]->kind == kind) {
+        objects[i] = fs.objects[loaded];
+      } else {
+        objects[i] = make_shared<Object>(*fs.kinds[kind].prototype);
+      }
+      get(buffer, at, state.pos[i]);
+      get(buffer, at, state.v[i]);
+      get(buffer, at, state.force[i]);
+    }
+    if (at != buffer.size()) {
+      LOG(ERROR) << "Snapshot is truncated or corrupted";
+      return false;
+    }
+    fs.frameCounter = frameCounter;
+    fs.stepSize = stepSize;
+    fs.seed = seed;
+    for (int i = 0; i < count; ++i) {
+      objects[i]->pos = state.pos[i];
+      objects[i]->v = state.v[i];
+      objects[i]->force = state.force[i];
+    }
+    fs.objects.swap(objects);
+    fs.slots = slots;
+    fs.reindex();
+    for (const auto &object : fs.objects) {
+      object->calFrame();
+    }
+    return true;
+  }
+
+  static bool loadFile(const string &fileName, FrameSystem &fs) {
+    ifstream file(fileName, ios::in | ios::binary);
+    if (not file.is_open()) {
+      LOG(ERROR) << "Cannot open snapshot file: " << fileName;
+      return false;
+    }
+    string buffer((istreambuf_iterator<char>(file)),
+                  istreambuf_iterator<char>());
+    return restore(buffer, fs);
+  }
+
+private:
+  static const int32_t kMagic = 0x53474349; // "ICGS"
+  static const int32_t kVersion = 4;
+
+  template <typename T> static void put(string &buffer, T value) {
+    buffer.append(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+
+  template <typename T>
+  static bool get(const string &buffer, size_t &at, T &value) {
+    if (at + sizeof(T) > buffer.size()) {
+      at = buffer.size() + 1;
+      return false;
+    }
+    memcpy(&value, buffer.data() + at, sizeof(T));
+    at += sizeof(T);
+    return true;
+  }
+};
+
+// Writes snapshots from a background thread so the step loop only pays for
+// serializing into memory. At most maxPending snapshots wait for the disk,
+// newer ones are dropped rather than stalling the simulation.
+class SnapshotWriter {
+public:
+  size_t maxPending{4};
+
+  SnapshotWriter() : worker([this] { run(); }) {}
+
+  ~SnapshotWriter() {
+    {
+      lock_guard<mutex> lock(mtx);
+      done = true;
+    }
+    cv.notify_one();
+    worker.join();
+  }
+
+  void write(const string &fileName, string &&buffer) {
+    {
+      lock_guard<mutex> lock(mtx);
+      if (pending.size() >= maxPending) {
+        LOG(WARNING) << "Snapshot writer is behind, dropping " << fileName;
+        return;
+      }
+      pending.emplace_back(fileName, move(buffer));
+    }
+    cv.notify_one();
+  }
+
+private:
+  mutex mtx;
+  condition_variable cv;
+  deque<pair<string, string>> pending;
+  bool done{false};
+  thread worker;
+
+  void run() {
+    unique_lock<mutex> lock(mtx);
+    while (true) {
+      cv.wait(lock, [this] { return done || !pending.empty(); });
+      if (pending.empty()) {
+        return;
+      }
+      auto job = move(pending.front());
+      pending.pop_front();
+      lock.unlock();
+      ofstream file(job.first, ios::out | ios::binary | ios::trunc);
+      file.write(job.second.data(), job.second.size());
+      if (!file) {
+        LOG(ERROR) << "Cannot write snapshot file: " << job.first;
+      }
+      lock.lock();
+    }
+  }
+};
+
+} // namespace ICG
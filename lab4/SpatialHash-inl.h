@@ -0,0 +1,97 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace ICG {
+
+// Uniform hash grid over object centers. An object is only moved between
+// buckets when it crosses a cell boundary, so bodies that stay put (or are
+// asleep) cost nothing to keep indexed.
+class SpatialHash {
+public:
+  typedef array<double, 3> point;
+  typedef array<int, 3> cell;
+
+  double cellSize{1};
+  unordered_map<int64_t, vector<int>> cells;
+  // bucket key of every id, -1 if not inserted
+  vector<int64_t> keyOf;
+
+  void reset(double size, int count) {
+    cellSize = size;
+    cells.clear();
+    keyOf.assign(count, -1);
+  }
+
+  int size() const { return keyOf.size(); }
+
+  cell cellOf(const point &pos) const {
+    return cell{(int)floor(pos[0] / cellSize), (int)floor(pos[1] / cellSize),
+                (int)floor(pos[2] / cellSize)};
+  }
+
+  static int64_t key(int x, int y, int z) {
+    // 21 bits per axis is plenty for any scene we load
+    const int64_t mask = (1 << 21) - 1;
+    return ((x + (1 << 20)) & mask) | (((y + (1 << 20)) & mask) << 21) |
+           (((z + (1 << 20)) & mask) << 42);
+  }
+
+  // insert or move id to the bucket of pos
+  void update(int id, const point &pos) {
+    auto c = cellOf(pos);
+    int64_t k = key(c[0], c[1], c[2]);
+    if (keyOf[id] == k) {
+      return;
+    }
+    remove(id);
+    cells[k].emplace_back(id);
+    keyOf[id] = k;
+  }
+
+  void remove(int id) {
+    if (keyOf[id] == -1) {
+      return;
+    }
+    auto it = cells.find(keyOf[id]);
+    auto &bucket = it->second;
+    for (size_t i = 0; i < bucket.size(); ++i) {
+      if (bucket[i] == id) {
+        bucket[i] = bucket.back();
+        bucket.pop_back();
+        break;
+      }
+    }
+    if (bucket.empty()) {
+      cells.erase(it);
+    }
+    keyOf[id] = -1;
+  }
+
+  // visit every id whose bucket overlaps the box [lo, hi]
+  template <typename Func>
+  void query(const point &lo, const point &hi, Func func) const {
+    auto cLo = cellOf(lo), cHi = cellOf(hi);
+    for (int x = cLo[0]; x <= cHi[0]; ++x) {
+      for (int y = cLo[1]; y <= cHi[1]; ++y) {
+        for (int z = cLo[2]; z <= cHi[2]; ++z) {
+          auto it = cells.find(key(x, y, z));
+          if (it == cells.end()) {
+            continue;
+          }
+          for (int id : it->second) {
+            func(id);
+          }
+        }
+      }
+    }
+  }
+};
+
+} // namespace ICG
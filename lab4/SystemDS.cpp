@@ -1,8 +1,18 @@
 #include "SystemDS.h"
+#include "DistanceField-inl.h"
 #include "Loader-inl.h"
 #include "MatrixOp-inl.h"
+#include "Octree-inl.h"
+#include "PairKernel-inl.h"
+#include "Query-inl.h"
+#include "Snapshot-inl.h"
+#include "ThreadPool-inl.h"
+#include "Trajectory-inl.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <glog/logging.h>
 #include <iostream>
@@ -15,81 +25,667 @@ void Object::calFrame() {
   curFrame = make_shared<Frame>(initVec, false);
 };
 
-void Object::calPos(const double &deltaT) {
+const double Object::vMax = 1.5;
+
+static double clampV(double v) {
+  if (v >= 0) {
+    return min(v, Object::vMax);
+  }
+  return max(v, -Object::vMax);
+}
+
+void AgentState::resize(int n) {
+  pos.resize(n);
+  v.resize(n);
+  force.resize(n);
+}
+
+void AgentState::calPos(const AgentState &from, int id, double mass,
+                        const double &deltaT) {
   for (int i = 0; i < 3; ++i) {
-    double newV = v[i] + force[i] / mass * deltaT;
-    if (newV >= 0) {
-      newV = min(newV, 1.5);
-    } else {
-      newV = max(newV, -1.5);
-    }
-    pos[i] += (newV + v[i]) / 2 * deltaT;
-    v[i] = newV;
+    double newV = clampV(from.v[id][i] + from.force[id][i] / mass * deltaT);
+    pos[id][i] = from.pos[id][i] + (newV + from.v[id][i]) / 2 * deltaT;
+    v[id][i] = newV;
   }
-};
+}
 
-static double distance(shared_ptr<Object> a, shared_ptr<Object> b) {
-  double sum = 0;
+void AgentState::calVel(const AgentState &from, int id, double mass,
+                        const double &deltaT) {
   for (int i = 0; i < 3; ++i) {
-    sum += (a->pos[i] - b->pos[i]) * (a->pos[i] - b->pos[i]);
+    v[id][i] = clampV(from.v[id][i] + from.force[id][i] / mass * deltaT);
   }
-  return sqrt(sum) - a->radius - b->radius;
 }
 
-static double distance(shared_ptr<Object> a, const vec3 &b) {
-  double sum = 0;
+void AgentState::drift(const AgentState &from, int id, const double &deltaT) {
   for (int i = 0; i < 3; ++i) {
-    sum += (a->pos[i] - b[i]) * (a->pos[i] - b[i]);
+    pos[id][i] = from.pos[id][i] + v[id][i] * deltaT;
   }
-  return sqrt(sum);
 }
 
-void FrameSystem::calForce() {
-  for (int i = 0; i < objects.size(); ++i) {
-    if (objects[i]->type != OBJ_GROUP) {
+// objects handed to one thread at a time by the step loops
+static const int kChunk = 256;
+// agents are heavier, smaller chunks balance better
+static const int kForceChunk = 32;
+
+// func(i) for every object, each object on one thread
+template <typename Func>
+static void forEachObject(ThreadPool &pool, int n, Func func) {
+  pool.parallelFor(n, kChunk, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      func(i);
+    }
+  });
+}
+
+ThreadPool &FrameSystem::pool() {
+  if (!threadPool) {
+    threadPool = make_shared<ThreadPool>(
+        threads > 0 ? threads : thread::hardware_concurrency());
+  }
+  return *threadPool;
+}
+
+void FrameSystem::step() {
+  frameCounter++;
+  // the des order is sorted on the first frame
+  if (sortEvery > 0 && (frameCounter - 1) % sortEvery == 0) {
+    sortObjects();
+  }
+  int substeps = calSubsteps();
+  loadState();
+  lod.active = lod.near > 0;
+  if (lod.active) {
+    scheduleLod(state[front].pos);
+  }
+  for (int s = 0; s < substeps; ++s) {
+    if (integrator.type == INTEGRATOR_ADAPTIVE) {
+      integrateAdaptive(deltaT / substeps);
+    } else {
+      integrate(deltaT / substeps);
+    }
+  }
+  lod.active = false;
+  storeState();
+  forEachObject(pool(), objects.size(),
+                [&](int i) { objects[i]->calFrame(); });
+}
+
+void FrameSystem::loadState() {
+  auto &cur = state[front];
+  cur.resize(objects.size());
+  state[!front].resize(objects.size());
+  forEachObject(pool(), objects.size(), [&](int i) {
+    cur.pos[i] = objects[i]->pos;
+    cur.v[i] = objects[i]->v;
+    cur.force[i] = objects[i]->force;
+  });
+}
+
+void FrameSystem::storeState() {
+  const auto &cur = state[front];
+  forEachObject(pool(), objects.size(), [&](int i) {
+    objects[i]->pos = cur.pos[i];
+    objects[i]->v = cur.v[i];
+    objects[i]->force = cur.force[i];
+  });
+}
+
+int FrameSystem::calSubsteps() const {
+  // enough substeps that no object moves more than maxMove of its radius
+  double ratio = 0;
+  for (const auto &object : objects) {
+    double speed = sqrt(object->v[0] * object->v[0] +
+                        object->v[1] * object->v[1] +
+                        object->v[2] * object->v[2]);
+    ratio = max(ratio, speed * deltaT / (integrator.maxMove * object->radius));
+  }
+  return max(1, min(integrator.maxSubsteps, (int)ceil(ratio)));
+}
+
+// one step from the front state into the back one, forces always belong
+// to the positions they are stored with
+void FrameSystem::advance(const double &deltaT) {
+  const auto &from = state[front];
+  auto &to = state[!front];
+  int cnt = objects.size();
+  switch (integrator.type) {
+  case INTEGRATOR_TRAPEZOID:
+    forEachObject(pool(), cnt, [&](int i) {
+      to.calPos(from, i, objects[i]->mass, deltaT);
+      to.force[i] = from.force[i];
+    });
+    calForce(to);
+    break;
+  case INTEGRATOR_EULER:
+    forEachObject(pool(), cnt, [&](int i) {
+      to.calVel(from, i, objects[i]->mass, deltaT);
+      to.drift(from, i, deltaT);
+      to.force[i] = from.force[i];
+    });
+    calForce(to);
+    break;
+  case INTEGRATOR_VERLET:
+  case INTEGRATOR_ADAPTIVE:
+    // kick, drift, kick with the second kick from the new forces
+    forEachObject(pool(), cnt, [&](int i) {
+      to.calVel(from, i, objects[i]->mass, deltaT / 2);
+      to.drift(from, i, deltaT);
+      to.force[i] = from.force[i];
+    });
+    calForce(to);
+    forEachObject(pool(), cnt, [&](int i) {
+      to.calVel(to, i, objects[i]->mass, deltaT / 2);
+    });
+    break;
+  }
+}
+
+void FrameSystem::integrate(const double &deltaT) {
+  advance(deltaT);
+  front = !front;
+}
+
+// Verlet steps sized so that the change of acceleration over a step, which
+// Verlet does not see, moves no object more than the tolerance. A rejected
+// step is dropped by not swapping the states.
+void FrameSystem::integrateAdaptive(const double &deltaT) {
+  double minStep = deltaT / integrator.maxSubsteps;
+  if (stepSize <= 0) {
+    stepSize = deltaT;
+  }
+  int cnt = objects.size();
+  double t = 0;
+  while (t < deltaT) {
+    // the last step of a frame is cut to what is left of it
+    bool cut = stepSize > deltaT - t;
+    double step = cut ? deltaT - t : stepSize;
+    advance(step);
+    const auto &from = state[front], &to = state[!front];
+    double error = 0;
+    for (int i = 0; i < cnt; ++i) {
+      for (int k = 0; k < 3; ++k) {
+        error = max(error, abs(to.force[i][k] - from.force[i][k]) /
+                               objects[i]->mass * step * step / 2);
+      }
+    }
+    if (error > integrator.tolerance && step > minStep) {
+      stepSize = max(step / 2, minStep);
       continue;
     }
-    for (int k = 0; k < 3; ++k) {
-      objects[i]->force[k] = 0;
+    front = !front;
+    t += step;
+    // a cut step says little about the next one, which keeps the size
+    // proposed before it
+    if (!cut) {
+      double grow = 0.9 * sqrt(integrator.tolerance / max(error, 1e-12));
+      stepSize = max(minStep, step * min(2.0, grow));
     }
+  }
+}
 
-    for (int j = 0; j < objects.size(); ++j) {
-      if (j == i) {
-        continue;
+// agents closer than kRepulsionRange push apart, farther than
+// kCohesionRange they pull together
+static const double kRepulsionRange = 5;
+static const double kCohesionRange = 10;
+// a source kind this small is cheaper to loop over than to look up
+static const size_t kSmallKind = 64;
+
+int FrameSystem::addKind(ObjType type, const Forces &forces) {
+  if (type != OBJ_GROUP) {
+    for (size_t k = 0; k < kinds.size(); ++k) {
+      if (kinds[k].type == type) {
+        return k;
       }
-      double dis = distance(objects[i], objects[j]);
-      if (objects[j]->type == OBJ_FOOD) {
-        for (int k = 0; k < 3; ++k) {
-          objects[i]->force[k] += (objects[j]->pos[k] - objects[i]->pos[k]) /
-                                  (dis)*objects[i]->forces->food;
+    }
+  }
+  kinds.emplace_back();
+  kinds.back().type = type;
+  kinds.back().forces = forces;
+  kinds.back().tree = make_shared<Octree>();
+  return kinds.size() - 1;
+}
+
+void FrameSystem::defaultInteractions() {
+  int n = kinds.size();
+  interactions.assign(n, vector<Interaction>(n));
+  for (int a = 0; a < n; ++a) {
+    if (kinds[a].type != OBJ_GROUP) {
+      continue;
+    }
+    const auto &forces = kinds[a].forces;
+    for (int b = 0; b < n; ++b) {
+      auto &terms = interactions[a][b].terms;
+      if (kinds[b].type == OBJ_FOOD) {
+        terms.push_back({forces.food, 1});
+      } else if (kinds[b].type == OBJ_BARRIER) {
+        terms.push_back({-forces.barrier, 1, -HUGE_VAL, 0, 1});
+      } else {
+        terms.push_back({-forces.repulsion, 3, -HUGE_VAL, kRepulsionRange});
+        if (forces.group != 0) {
+          terms.push_back({forces.group, 3, kCohesionRange});
         }
       }
-      if (objects[j]->type == OBJ_BARRIER && dis < objects[j]->radius) {
+    }
+  }
+}
+
+void FrameSystem::calForce() {
+  loadState();
+  calForce(state[front]);
+  storeState();
+}
+
+void FrameSystem::calForce(AgentState &cur) {
+  indexKinds();
+  indexNeighbors(cur.pos);
+  // only the long-range terms of a source walk its tree
+  for (size_t b = 0; b < kinds.size(); ++b) {
+    bool global = false;
+    for (size_t a = 0; a < kinds.size() && !global; ++a) {
+      global = !interactions[a][b].global.empty();
+    }
+    if (global) {
+      kinds[b].tree->build(radii, cur.pos, kinds[b].members);
+    }
+  }
+  // every agent only writes its own force, the ones not due keep the
+  // force advance carried over
+  const auto &update = lod.active ? lod.due : agents;
+  pool().parallelFor(update.size(), kForceChunk, [&](int begin, int end) {
+    for (int g = begin; g < end; ++g) {
+      calForce(cur, update[g]);
+    }
+  });
+}
+
+void FrameSystem::calForce(AgentState &cur, int i) {
+  const auto &object = objects[i];
+  const auto &pos = cur.pos[i];
+  auto &force = cur.force[i];
+  force = {0, 0, 0};
+  const auto &row = interactions[object->kind];
+  for (size_t b = 0; b < kinds.size(); ++b) {
+    const auto &interaction = row[b];
+    for (const auto &term : interaction.global) {
+      vec3 pull =
+          kinds[b].tree->field(pos, object->radius, i, theta,
+                               InverseLaw{term.scale, term.power, term.near});
+      for (int k = 0; k < 3; ++k) {
+        force[k] += pull[k];
+      }
+    }
+    if (interaction.local.empty()) {
+      continue;
+    }
+    if (kinds[b].field) {
+      // the closest baked body stands for all of them, seen from it the
+      // offset toward its center runs down the gradient
+      auto closest = kinds[b].field->sample(pos);
+      double gap = closest.dis - object->radius;
+      for (const auto &term : interaction.local) {
+        if (gap <= term.near ||
+            gap >= term.far + term.farRadius * closest.radius) {
+          continue;
+        }
+        double w = term.power == 1 ? term.scale / gap
+                                   : term.scale / (gap * gap * gap);
         for (int k = 0; k < 3; ++k) {
-          objects[i]->force[k] += (objects[i]->pos[k] - objects[j]->pos[k]) /
-                                  (dis)*objects[i]->forces->barrier;
+          force[k] -= closest.grad[k] * (closest.dis + closest.radius) * w;
         }
       }
-      if (objects[j]->type == OBJ_GROUP) {
-        if (dis < 5) {
-          for (int k = 0; k < 3; ++k) {
-            objects[i]->force[k] += (objects[i]->pos[k] - objects[j]->pos[k]) /
-                                    (dis * dis * dis) *
-                                    objects[i]->forces->repulsion;
+    }
+    // candidates are gathered once and every term runs over them. Only
+    // the ones some term reaches go in, so the lanes the kernel sums depend
+    // on the positions alone and not on when the list was last rebuilt.
+    thread_local PairBatch batch;
+    batch.clear();
+    for (int j : nearby.of(i, b)) {
+      double d2 = 0;
+      for (int k = 0; k < 3; ++k) {
+        d2 += (cur.pos[j][k] - pos[k]) * (cur.pos[j][k] - pos[k]);
+      }
+      for (const auto &term : interaction.local) {
+        double cut =
+            term.far + term.farRadius * radii[j] + object->radius + radii[j];
+        if (d2 < cut * cut) {
+          batch.push(cur.pos[j], radii[j], j);
+          break;
+        }
+      }
+    }
+    for (const auto &term : interaction.local) {
+      PairKernel::accumulate(pos, object->radius, i, batch, term, force);
+    }
+  }
+}
+
+bool FrameSystem::bakeField(double cell, double margin, const string &cache) {
+  for (size_t b = 0; b < kinds.size(); ++b) {
+    if (kinds[b].type != OBJ_BARRIER) {
+      continue;
+    }
+    vector<DistanceField::Body> bodies;
+    for (const auto &object : objects) {
+      if (object->kind == (int)b) {
+        bodies.push_back({object->pos, object->radius, object->shape.get()});
+      }
+    }
+    if (bodies.empty()) {
+      continue;
+    }
+    // past margin the field reads margin with no gradient, so it has to
+    // cover the farthest surface a local term of the kind still pushes from
+    double reach = 0, radius = 0, agentRadius = 0;
+    for (const auto &body : bodies) {
+      radius = max(radius, body.radius);
+    }
+    for (size_t a = 0; a < kinds.size(); ++a) {
+      for (const auto &term : interactions[a][b].terms) {
+        if (term.far == HUGE_VAL) {
+          continue;
+        }
+        agentRadius = 0;
+        for (const auto &object : objects) {
+          if (object->kind == (int)a) {
+            agentRadius = max(agentRadius, object->radius);
           }
-        } else if (dis > 10) {
+        }
+        reach = max(reach, term.far + term.farRadius * radius + agentRadius);
+      }
+    }
+    if (margin < reach) {
+      LOG(ERROR) << "Field margin " << margin << " is short of the reach "
+                 << reach << " of the forces from barrier kind " << b;
+      return false;
+    }
+    auto field = make_shared<DistanceField>();
+    uint64_t key = DistanceField::fingerprint(bodies, cell, margin);
+    if (cache.empty() || !field->load(cache, key)) {
+      auto start = chrono::steady_clock::now();
+      if (!field->build(bodies, cell, margin, pool())) {
+        return false;
+      }
+      LOG(INFO) << "Baked " << bodies.size() << " barriers into "
+                << field->nodes.size() << " nodes in "
+                << chrono::duration<double>(chrono::steady_clock::now() - start)
+                       .count()
+                << " s";
+      if (!cache.empty() && !field->save(cache, key)) {
+        LOG(WARNING) << "Cannot write distance field cache: " << cache;
+      }
+    }
+    for (const auto &object : objects) {
+      object->baked = object->baked || object->kind == (int)b;
+    }
+    kinds[b].field = field;
+  }
+  reindex();
+  return true;
+}
+
+void FrameSystem::indexKinds() {
+  int cnt = objects.size();
+  if (kinds.empty() || kinds[0].neighbors.size() != cnt) {
+    for (auto &kind : kinds) {
+      kind.members.clear();
+      kind.maxRadius = 0;
+    }
+    radii.resize(cnt);
+    for (int i = 0; i < cnt; ++i) {
+      auto &kind = kinds[objects[i]->kind];
+      radii[i] = objects[i]->radius;
+      if (objects[i]->baked) {
+        continue;
+      }
+      kind.members.emplace_back(i);
+      kind.maxRadius = max(kind.maxRadius, radii[i]);
+    }
+    agents.clear();
+    // a source hashes its members in cells as wide as the longest reach
+    // of its local terms plus the skin, so a query spans at most 3 cells
+    // per axis
+    vector<double> cell(kinds.size(), 1e-3);
+    for (size_t a = 0; a < kinds.size(); ++a) {
+      bool agent = false;
+      for (size_t b = 0; b < kinds.size(); ++b) {
+        auto &interaction = interactions[a][b];
+        interaction.local.clear();
+        interaction.global.clear();
+        interaction.reach = 0;
+        for (const auto &term : interaction.terms) {
+          if (term.far == HUGE_VAL) {
+            interaction.global.emplace_back(term);
+            continue;
+          }
+          interaction.local.emplace_back(term);
+          interaction.reach =
+              max(interaction.reach, term.far + kinds[a].maxRadius +
+                                         (1 + term.farRadius) *
+                                             kinds[b].maxRadius);
+        }
+        cell[b] = max(cell[b], interaction.reach);
+        agent = agent || !interaction.terms.empty();
+      }
+      if (agent) {
+        agents.insert(agents.end(), kinds[a].members.begin(),
+                      kinds[a].members.end());
+      }
+    }
+    for (size_t b = 0; b < kinds.size(); ++b) {
+      kinds[b].neighbors.reset(cell[b] + nearby.skin, cnt);
+    }
+    nearby.reset(cnt, kinds.size());
+  }
+}
+
+void FrameSystem::indexNeighbors(const vector<vec3> &pos) {
+  if (!nearby.stale(pos)) {
+    return;
+  }
+  int nk = kinds.size();
+  vector<char> local(nk, false);
+  for (int a = 0; a < nk; ++a) {
+    for (int b = 0; b < nk; ++b) {
+      local[b] = local[b] || !interactions[a][b].local.empty();
+    }
+  }
+  for (int b = 0; b < nk; ++b) {
+    if (local[b] && kinds[b].members.size() > kSmallKind) {
+      for (int i : kinds[b].members) {
+        kinds[b].neighbors.update(i, pos[i]);
+      }
+    }
+  }
+  // every agent only fills its own lists
+  pool().parallelFor(agents.size(), kForceChunk, [&](int begin, int end) {
+    for (int g = begin; g < end; ++g) {
+      int i = agents[g];
+      const auto &p = pos[i];
+      const auto &row = interactions[objects[i]->kind];
+      for (int b = 0; b < nk; ++b) {
+        auto &list = nearby.of(i, b);
+        list.clear();
+        if (row[b].local.empty()) {
+          continue;
+        }
+        double range = row[b].reach + nearby.skin;
+        auto push = [&](int j) {
+          double d2 = 0;
           for (int k = 0; k < 3; ++k) {
-            objects[i]->force[k] += (objects[j]->pos[k] - objects[i]->pos[k]) /
-                                    (dis * dis * dis) *
-                                    objects[i]->forces->group;
+            d2 += (pos[j][k] - p[k]) * (pos[j][k] - p[k]);
+          }
+          if (j != i && d2 < range * range) {
+            list.emplace_back(j);
           }
+        };
+        if (kinds[b].members.size() <= kSmallKind) {
+          for (int j : kinds[b].members) {
+            push(j);
+          }
+          continue;
         }
+        vec3 lo, hi;
+        for (int k = 0; k < 3; ++k) {
+          lo[k] = p[k] - range;
+          hi[k] = p[k] + range;
+        }
+        kinds[b].neighbors.query(lo, hi, push);
+        // the hash lists its cells in the order they were filled, sorted the
+        // forces sum in the same order after a restore
+        sort(list.begin(), list.end());
+      }
+    }
+  });
+  nearby.anchor = pos;
+}
+
+void FrameSystem::scheduleLod(const vector<vec3> &pos) {
+  indexKinds();
+  vector<pair<vec3, double>> targets{{viewer, 0}};
+  for (const auto &kind : kinds) {
+    if (kind.type != OBJ_FOOD) {
+      continue;
+    }
+    for (int i : kind.members) {
+      targets.emplace_back(pos[i], radii[i]);
+    }
+  }
+  // the slot keeps the phase of an agent across sorts and removals
+  lod.schedule(frameCounter, agents, pos, slots.slotOf, targets);
+}
+
+void FrameSystem::indexBroadphase() {
+  int cnt = objects.size();
+  if (broadphase.size() != cnt) {
+    double maxRadius = 1e-3;
+    for (const auto &object : objects) {
+      maxRadius = max(maxRadius, object->radius);
+    }
+    broadphase.reset(2 * maxRadius, cnt);
+  }
+  for (int i = 0; i < cnt; ++i) {
+    broadphase.update(i, objects[i]->pos);
+  }
+}
+
+// bits of x spread to every third bit
+static uint64_t spreadBits(uint64_t x) {
+  x &= (1 << 21) - 1;
+  x = (x | x << 32) & 0x1f00000000ffffULL;
+  x = (x | x << 16) & 0x1f0000ff0000ffULL;
+  x = (x | x << 8) & 0x100f00f00f00f00fULL;
+  x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+  x = (x | x << 2) & 0x1249249249249249ULL;
+  return x;
+}
+
+void FrameSystem::sortObjects() {
+  int cnt = objects.size();
+  if (cnt == 0) {
+    return;
+  }
+  vec3 lo{HUGE_VAL, HUGE_VAL, HUGE_VAL}, hi{-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+  for (const auto &object : objects) {
+    for (int k = 0; k < 3; ++k) {
+      lo[k] = min(lo[k], object->pos[k]);
+      hi[k] = max(hi[k], object->pos[k]);
+    }
+  }
+  // centers quantized to 21 bits per axis of the bounding box
+  vector<uint64_t> code(cnt);
+  for (int i = 0; i < cnt; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      double extent = max(hi[k] - lo[k], 1e-9);
+      double q = (objects[i]->pos[k] - lo[k]) / extent * ((1 << 21) - 1);
+      code[i] |= spreadBits(q) << k;
+    }
+  }
+  vector<int> perm(cnt);
+  for (int i = 0; i < cnt; ++i) {
+    perm[i] = i;
+  }
+  stable_sort(perm.begin(), perm.end(), [&](int a, int b) {
+    int ka = objects[a]->kind, kb = objects[b]->kind;
+    return ka != kb ? ka < kb : code[a] < code[b];
+  });
+  vector<shared_ptr<Object>> sorted(cnt);
+  for (int s = 0; s < cnt; ++s) {
+    sorted[s] = objects[perm[s]];
+  }
+  objects.swap(sorted);
+  slots.permute(perm);
+  reindex();
+}
+
+void FrameSystem::reindex() {
+  // indexKinds rebuilds the kinds when their hashes no longer fit the
+  // count, with no objects left there is nothing to rebuild
+  for (auto &kind : kinds) {
+    kind.members.clear();
+    kind.neighbors.reset(kind.neighbors.cellSize, 0);
+  }
+  agents.clear();
+  nearby.reset(0, 0);
+  broadphase.reset(broadphase.cellSize, 0);
+  queryFrame = -1;
+}
+
+SlotMap::Handle FrameSystem::spawn(const shared_ptr<Object> &object) {
+  auto &kind = kinds[object->kind];
+  if (!kind.prototype) {
+    kind.prototype = make_shared<Object>(*object);
+  }
+  objects.emplace_back(object);
+  reindex();
+  return slots.insert();
+}
+
+SlotMap::Handle FrameSystem::spawn(int kind, const vec3 &pos) {
+  if (kind < 0 || kind >= (int)kinds.size() || !kinds[kind].prototype) {
+    return SlotMap::Handle();
+  }
+  auto object = make_shared<Object>(*kinds[kind].prototype);
+  object->pos = pos;
+  object->v = {0, 0, 0};
+  object->force = {0, 0, 0};
+  object->calFrame();
+  return spawn(object);
+}
+
+bool FrameSystem::despawn(const SlotMap::Handle &handle) {
+  int i = slots.remove(handle);
+  if (i < 0) {
+    return false;
+  }
+  objects[i] = objects.back();
+  objects.pop_back();
+  reindex();
+  return true;
+}
+
+shared_ptr<Object> FrameSystem::find(const SlotMap::Handle &handle) const {
+  int i = slots.find(handle);
+  return i < 0 ? nullptr : objects[i];
+}
+
+Philox FrameSystem::random(RandomStream stream, int entity) const {
+  return Philox(seed, stream, entity);
+}
+
+WorldQuery FrameSystem::query() {
+  if (queryFrame != frameCounter || broadphase.size() != (int)objects.size()) {
+    indexBroadphase();
+    queryLo = {HUGE_VAL, HUGE_VAL, HUGE_VAL};
+    queryHi = {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+    for (const auto &object : objects) {
+      for (int k = 0; k < 3; ++k) {
+        queryLo[k] = min(queryLo[k], object->pos[k]);
+        queryHi[k] = max(queryHi[k], object->pos[k]);
       }
     }
-    // for (int k = 0; k < 3; ++k) {
-    //   LOG(ERROR) << objects[i]->force[k];
-    // }
+    queryFrame = frameCounter;
   }
+  return WorldQuery(broadphase, objects, queryLo, queryHi);
 }
 
 // Implementation of CoreCGSystem
@@ -99,8 +695,169 @@ void CoreCGSystem::loadDataFromFile(const string &desFile) {
   }
 }
 
+void CoreCGSystem::checkTheta() {
+  auto &fs = *frameSystem;
+  auto timed = [&](double theta, vector<vec3> &forces) {
+    fs.theta = theta;
+    auto start = chrono::steady_clock::now();
+    fs.calForce();
+    chrono::duration<double, milli> elapsed =
+        chrono::steady_clock::now() - start;
+    forces.clear();
+    for (const auto &object : fs.objects) {
+      forces.emplace_back(object->force);
+    }
+    return elapsed.count();
+  };
+  double theta = fs.theta;
+  vector<vec3> exact, approx;
+  double exactTime = timed(0, exact);
+  double approxTime = timed(theta, approx);
+  double maxError = 0, sumError = 0;
+  int agents = fs.agents.size();
+  for (int i : fs.agents) {
+    double diff = 0, norm = 0;
+    for (int k = 0; k < 3; ++k) {
+      diff += (approx[i][k] - exact[i][k]) * (approx[i][k] - exact[i][k]);
+      norm += exact[i][k] * exact[i][k];
+    }
+    double error = norm > 0 ? sqrt(diff / norm) : sqrt(diff);
+    maxError = max(maxError, error);
+    sumError += error;
+  }
+  LOG(INFO) << "theta " << theta << " over " << agents
+            << " agents: relative force error max " << maxError << " mean "
+            << (agents ? sumError / agents : 0) << ", " << approxTime
+            << " ms against " << exactTime << " ms exact";
+}
+
+void CoreCGSystem::restoreFromFile(const string &snapshotFile) {
+  if (!Snapshot::loadFile(snapshotFile, *frameSystem)) {
+    LOG(FATAL) << "Failed to restore snapshot: " << snapshotFile;
+  }
+}
+
+void CoreCGSystem::saveSnapshot() {
+  if (!snapshotWriter) {
+    snapshotWriter = make_shared<SnapshotWriter>();
+  }
+  string buffer;
+  Snapshot::save(*frameSystem, buffer);
+  snapshotWriter->write(snapshotPrefix + "_" +
+                            to_string(frameSystem->frameCounter) + ".bin",
+                        move(buffer));
+}
+
+void CoreCGSystem::startRecording(const string &fileName) {
+  recorder = make_shared<TrajectoryWriter>(fileName);
+}
+
+void CoreCGSystem::recordFrame() {
+  // objects here have no orientation, those channels stay zero and cost
+  // one bit each
+  vector<double> values;
+  vector<trajectory::Body> bodies;
+  auto &fs = *frameSystem;
+  values.reserve(fs.objects.size() * trajectory::kChannels);
+  bodies.reserve(fs.objects.size());
+  // in slot order whatever the objects are sorted by, that is the order of
+  // the des file until objects are removed
+  for (int slot = 0; slot < fs.slots.capacity(); ++slot) {
+    if (fs.slots.index[slot] < 0) {
+      continue;
+    }
+    const auto &object = fs.objects[fs.slots.index[slot]];
+    values.insert(values.end(), object->pos.begin(), object->pos.end());
+    values.insert(values.end(), 3, 0);
+    bodies.push_back({slot, fs.slots.generation[slot], object->kind});
+  }
+  recorder->push(frameSystem->frameCounter, move(values), move(bodies));
+}
+
+void CoreCGSystem::startPlayback(const string &fileName, double speed) {
+  player = make_shared<TrajectoryReader>();
+  if (!player->open(fileName)) {
+    LOG(FATAL) << "Failed to read trajectory file: " << fileName;
+  }
+  playSpeed = speed;
+  playCursor = 0;
+  // the recording starts from the scene loaded here
+  auto &slots = frameSystem->slots;
+  played.assign(slots.capacity(), SlotMap::Handle());
+  playedGeneration.assign(slots.capacity(), 0);
+  for (int slot = 0; slot < slots.capacity(); ++slot) {
+    if (slots.index[slot] >= 0) {
+      played[slot] = slots.handleAt(slots.index[slot]);
+      playedGeneration[slot] = slots.generation[slot];
+    }
+  }
+}
+
+void CoreCGSystem::playFrame() {
+  vector<double> values;
+  vector<trajectory::Body> bodies;
+  int frame = playCursor;
+  auto &fs = *frameSystem;
+  if (!player->read(frame, fs.frameCounter, values, bodies)) {
+    LOG(ERROR) << "Cannot read trajectory frame " << frame
+               << ", playback stops";
+    player.reset();
+    return;
+  }
+  // an object whose recorded slot is gone or holds a new generation was
+  // despawned, one in a slot without a handle here was spawned
+  vector<char> kept(played.size(), false);
+  for (const auto &body : bodies) {
+    if (body.slot >= 0 && body.slot < (int)played.size() &&
+        playedGeneration[body.slot] == body.generation) {
+      kept[body.slot] = true;
+    }
+  }
+  for (size_t slot = 0; slot < played.size(); ++slot) {
+    if (played[slot].slot >= 0 && !kept[slot]) {
+      fs.despawn(played[slot]);
+      played[slot] = SlotMap::Handle();
+    }
+  }
+  for (size_t i = 0; i < bodies.size(); ++i) {
+    const auto &body = bodies[i];
+    vec3 pos;
+    for (int k = 0; k < 3; ++k) {
+      pos[k] = values[i * trajectory::kChannels + k];
+    }
+    if (body.slot < 0) {
+      LOG(ERROR) << "Trajectory frame " << frame << " does not fit the scene";
+      player.reset();
+      return;
+    }
+    if (body.slot >= (int)played.size()) {
+      played.resize(body.slot + 1);
+      playedGeneration.resize(body.slot + 1, 0);
+    }
+    if (played[body.slot].slot < 0) {
+      played[body.slot] = fs.spawn(body.kind, pos);
+      playedGeneration[body.slot] = body.generation;
+    }
+    auto object = fs.find(played[body.slot]);
+    if (!object) {
+      LOG(ERROR) << "Trajectory frame " << frame << " does not fit the scene";
+      player.reset();
+      return;
+    }
+    object->pos = pos;
+    object->calFrame();
+  }
+  // loop over the recording in either direction
+  int count = player->frameCount();
+  playCursor = fmod(playCursor + playSpeed, count);
+  if (playCursor < 0) {
+    playCursor += count;
+  }
+}
+
 // Implementation of GLUTSystem
 shared_ptr<CoreCGSystem> GLUTSystem::cgSystem = nullptr;
+SlotMap::Handle GLUTSystem::picked;
 
 void GLUTSystem::init(shared_ptr<CoreCGSystem> cgSystemArg) {
   cgSystem = cgSystemArg;
@@ -108,12 +865,18 @@ void GLUTSystem::init(shared_ptr<CoreCGSystem> cgSystemArg) {
 
 // frameSystem update func
 void GLUTSystem::update(void) {
-  cgSystem->frameSystem->frameCounter++;
-  for (const auto &object : cgSystem->frameSystem->objects) {
-    object->calPos(cgSystem->frameSystem->deltaT);
-    object->calFrame();
+  if (cgSystem->player) {
+    cgSystem->playFrame();
+    return;
+  }
+  cgSystem->frameSystem->step();
+  if (cgSystem->recorder) {
+    cgSystem->recordFrame();
+  }
+  if (cgSystem->snapshotEvery > 0 &&
+      cgSystem->frameSystem->frameCounter % cgSystem->snapshotEvery == 0) {
+    cgSystem->saveSnapshot();
   }
-  cgSystem->frameSystem->calForce();
 }
 // draw model func
 void GLUTSystem::drawModel(shared_ptr<Object> object, bool trans) {
@@ -139,7 +902,7 @@ void GLUTSystem::drawModel(shared_ptr<Object> object, bool trans) {
     glMultMatrixd(&(scalingMatrix.mat[0]));
   }
 
-  glColor3f(0, 0, 0);
+  glColor3f(object == cgSystem->frameSystem->find(picked) ? 1 : 0, 0, 0);
   glCallList(object->modelID);
 
   glPopMatrix();
@@ -165,7 +928,54 @@ void GLUTSystem::render(void) {
   glutSwapBuffers();
 }
 // callback for keyboard
-void GLUTSystem::keyboard(unsigned char key, int x, int y) {}
+void GLUTSystem::keyboard(unsigned char key, int x, int y) {
+  auto &fs = *cgSystem->frameSystem;
+  auto object = fs.find(picked);
+  // a replay moves the recorded objects only
+  if (!object || cgSystem->player) {
+    return;
+  }
+  if (key == 'x') {
+    fs.despawn(picked);
+    LOG(INFO) << "Removed object in slot " << picked.slot;
+  } else if (key == 'c') {
+    vec3 pos = object->pos;
+    pos[0] += 3 * object->radius;
+    auto handle = fs.spawn(object->kind, pos);
+    LOG(INFO) << "Added object in slot " << handle.slot;
+  }
+  glutPostRedisplay();
+}
+// callback for mouse
+void GLUTSystem::mouse(int button, int state, int x, int y) {
+  if (button != GLUT_LEFT_BUTTON || state != GLUT_DOWN) {
+    return;
+  }
+  // unproject the cursor on the near and far planes of the current view
+  GLdouble model[16], proj[16];
+  GLint view[4];
+  glGetDoublev(GL_MODELVIEW_MATRIX, model);
+  glGetDoublev(GL_PROJECTION_MATRIX, proj);
+  glGetIntegerv(GL_VIEWPORT, view);
+  double winY = view[3] - y - 1;
+  vec3 near, far;
+  gluUnProject(x, winY, 0, model, proj, view, &near[0], &near[1], &near[2]);
+  gluUnProject(x, winY, 1, model, proj, view, &far[0], &far[1], &far[2]);
+  Ray ray;
+  ray.origin = near;
+  for (int k = 0; k < 3; ++k) {
+    ray.dir[k] = far[k] - near[k];
+  }
+  RayHit hit;
+  auto &fs = *cgSystem->frameSystem;
+  if (fs.query().raycast(ray, hit)) {
+    picked = fs.slots.handleAt(hit.id);
+    LOG(INFO) << "Picked object " << hit.id << " at distance " << hit.t;
+  } else {
+    picked = SlotMap::Handle();
+  }
+  glutPostRedisplay();
+}
 // callback for reshape
 void GLUTSystem::reshape(int w, int h) {
   glViewport(0, 0, w, h);
@@ -179,9 +989,7 @@ void GLUTSystem::reshape(int w, int h) {
 }
 // callback for timer
 void GLUTSystem::timer(int value) {
-  // increase frame index
-  cgSystem->frameSystem->frameCounter++;
-
+  // step counts the frames
   update();
 
   // render
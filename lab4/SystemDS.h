@@ -1,14 +1,30 @@
 #pragma once
 
 #include "Frame-inl.h"
+#include "LodScheduler-inl.h"
+#include "NeighborList-inl.h"
+#include "Philox-inl.h"
+#include "SlotMap-inl.h"
+#include "SpatialHash-inl.h"
 
 #include <GLUT/glut.h>
+#include <cmath>
 #include <vector>
 using namespace std;
 
 namespace ICG {
 typedef array<double, 3> vec3;
 
+class DistanceField;
+class Object;
+class Octree;
+class SnapshotWriter;
+class ThreadPool;
+class WorldQuery;
+class TrajectoryWriter;
+class TrajectoryReader;
+struct Triangle;
+
 struct Window {
   int height{600};
   int width{800};
@@ -22,6 +38,24 @@ enum ObjType {
     OBJ_GROUP
 };
 
+enum IntegratorType {
+  INTEGRATOR_TRAPEZOID = 0,
+  INTEGRATOR_EULER,
+  INTEGRATOR_VERLET,
+  INTEGRATOR_ADAPTIVE
+};
+
+struct Integrator {
+  IntegratorType type{INTEGRATOR_TRAPEZOID};
+  // a frame is split into substeps until no object moves more than maxMove
+  // of its radius per substep
+  double maxMove{0.5};
+  int maxSubsteps{16};
+  // largest position error per step allowed by INTEGRATOR_ADAPTIVE
+  double tolerance{1e-3};
+};
+
+// coefficients of a group line in the des file
 struct Forces {
   double food;
   double barrier;
@@ -29,23 +63,92 @@ struct Forces {
   double repulsion;
 };
 
+// scale / dis^power along the line toward the pushing body, positive pulls,
+// while near < dis < far + farRadius * the radius of the pushing body
+struct ForceTerm {
+  double scale;
+  int power{1};
+  double near{-HUGE_VAL};
+  double far{HUGE_VAL};
+  double farRadius{0};
+};
+
+// how bodies of one kind push agents of another
+struct Interaction {
+  vector<ForceTerm> terms;
+  // split by FrameSystem::indexKinds: local terms have a finite far and
+  // only see the bodies within reach, listed in FrameSystem::nearby, global
+  // ones sum over the tree of the source kind. The baked bodies of a kind
+  // answer its local terms from the distance field instead.
+  vector<ForceTerm> local, global;
+  double reach{0};
+};
+
+// The objects of one kind, as indices into the objects shared by every
+// kind. Barriers share one kind, so does food, and every group line of the
+// des file is a flock of its own. While sortEvery is set, sortObjects
+// orders the objects by kind, so the members are one run of consecutive
+// indices until the next spawn or despawn. As a source, a kind answers
+// short-range terms from its hash and long-range ones from its Barnes-Hut
+// tree.
+struct Kind {
+  ObjType type;
+  // des coefficients of a flock
+  Forces forces{0, 0, 0, 0};
+  // indices into FrameSystem::objects and its per-object arrays, ascending
+  vector<int> members;
+  double maxRadius{0};
+  SpatialHash neighbors;
+  shared_ptr<Octree> tree;
+  // static bodies of the kind baked at load time, they are left out of
+  // members
+  shared_ptr<DistanceField> field;
+  // copy of the first object loaded into the kind, what spawning one of
+  // the kind at runtime starts from
+  shared_ptr<Object> prototype;
+};
+
 class Object {
 public:
   const static double g;
+  const static double vMax;
 
   GLuint modelID{0};
   shared_ptr<Frame> curFrame;
   ObjType type;
-  shared_ptr<Forces> forces;
+  // index into FrameSystem::kinds
+  int kind{0};
 
   double radius;
+  // surface of an obstacle line inside the sphere of radius, nullptr for a
+  // sphere
+  shared_ptr<vector<Triangle>> shape;
+  // part of the distance field of its kind, removing it at runtime leaves
+  // it in the field
+  bool baked{false};
   double mass{1};
   vec3 v;
   vec3 pos;
   vec3 force;
 
   void calFrame();
-  void calPos(const double& deltaT);
+};
+
+// Positions, velocities and forces of every object. A step reads the front
+// copy and writes only the back one, which then becomes the front, so the
+// force and integration passes can run over any partition of the objects.
+struct AgentState {
+  vector<vec3> pos;
+  vector<vec3> v;
+  vector<vec3> force;
+
+  void resize(int n);
+  // object id moved one step past its state in from
+  void calPos(const AgentState &from, int id, double mass,
+              const double &deltaT);
+  void calVel(const AgentState &from, int id, double mass,
+              const double &deltaT);
+  void drift(const AgentState &from, int id, const double &deltaT);
 };
 
 class FrameSystem {
@@ -54,16 +157,120 @@ public:
   double deltaT{0.01};
   double offsetT{0};
   int fps{120};
+  Integrator integrator;
+  // last accepted step of INTEGRATOR_ADAPTIVE
+  double stepSize{0};
+  // key of every random draw of the scene, see random
+  uint64_t seed{0};
 
+  // dense, every loop over the objects and the arrays kept beside them
+  // index into it. Objects are added and removed between steps through
+  // spawn and despawn, anything kept across frames holds a handle.
   vector<shared_ptr<Object>> objects;
+  SlotMap slots;
+  // object centers in cells twice the largest radius
+  SpatialHash broadphase;
+  vector<Kind> kinds;
+  // interactions[a][b] is how kind b pushes agents of kind a, the kinds
+  // with any interaction are the agents
+  vector<vector<Interaction>> interactions;
+  vector<int> agents;
+  // radius of every object, next to each other in the object order
+  vector<double> radii;
+  // candidates of the local terms of every agent
+  NeighborList nearby;
+  // a tree node closer than 1 / theta of its size is opened, 0 is exact
+  double theta{0.5};
+  // workers of the force and integration loops and of the field bake, 0
+  // threads uses every core, read once when the pool is first used
+  int threads{0};
+  shared_ptr<ThreadPool> threadPool;
+
+  // agents far from the viewer and from food update their forces every
+  // few frames, the GL view looks from the origin
+  LodScheduler lod;
+  vec3 viewer{0, 0, 0};
+
+  // every sortEvery frames objects are re-sorted by kind and the Morton
+  // code of their centers so neighbors in space sit close in memory, 0
+  // keeps the order they were added in
+  int sortEvery{120};
+
+  // objects are copied into state[front] when a step starts and back when
+  // it ends
+  AgentState state[2];
+  int front{0};
 
+  void step();
+  int calSubsteps() const;
+  void loadState();
+  void storeState();
+  void advance(const double &deltaT);
+  void integrate(const double &deltaT);
+  void integrateAdaptive(const double &deltaT);
+  // forces of the objects at their positions
   void calForce();
+  void calForce(AgentState &cur);
+  // force on agent i, reads every position and writes only its own force
+  void calForce(AgentState &cur, int i);
+  ThreadPool &pool();
+  // index of the kind objects of type join, a new flock for OBJ_GROUP
+  int addKind(ObjType type, const Forces &forces = Forces());
+  // the interactions of the original flock: flocks seek food, avoid
+  // barriers, keep apart up close and pull together from afar
+  void defaultInteractions();
+  void indexKinds();
+  // bake the barriers loaded so far into distance fields of cell, reaching
+  // margin past every body, read from cache instead when it holds the same
+  // build
+  bool bakeField(double cell, double margin, const string &cache);
+  // rehash the sources and refill nearby when it is stale
+  void indexNeighbors(const vector<vec3> &pos);
+  void indexBroadphase();
+  // the agents of the current step in lod.due
+  void scheduleLod(const vector<vec3> &pos);
+  void sortObjects();
+  // objects were added, removed or reordered, every index over them is
+  // rebuilt
+  void reindex();
+  SlotMap::Handle spawn(const shared_ptr<Object> &object);
+  // a copy of the prototype of kind at rest at pos, an invalid handle if
+  // nothing was ever loaded into the kind
+  SlotMap::Handle spawn(int kind, const vec3 &pos);
+  // false if the object was already removed, the last object takes its
+  // index
+  bool despawn(const SlotMap::Handle &handle);
+  // nullptr once the object was removed
+  shared_ptr<Object> find(const SlotMap::Handle &handle) const;
+  // the draws of entity for stream, the same on every run and thread
+  Philox random(RandomStream stream, int entity) const;
+  // ray, sphere-cast and overlap queries over the current positions, valid
+  // until objects are added, removed or re-sorted. The first call of a
+  // frame indexes the objects, later ones reuse that.
+  WorldQuery query();
+  int queryFrame{-1};
+  vec3 queryLo, queryHi;
 };
 
 class CoreCGSystem {
 public:
   shared_ptr<Window> window;
   shared_ptr<FrameSystem> frameSystem;
+  // write a snapshot every snapshotEvery frames, 0 disables
+  int snapshotEvery{0};
+  string snapshotPrefix{"snapshot"};
+  shared_ptr<SnapshotWriter> snapshotWriter;
+  // record every frame to a trajectory file, or replay one instead of
+  // simulating at playSpeed recorded frames per frame
+  shared_ptr<TrajectoryWriter> recorder;
+  shared_ptr<TrajectoryReader> player;
+  double playSpeed{1};
+  double playCursor{0};
+  // handle in this scene of the object in every recorded slot, and the
+  // generation it was recorded with, so playback spawns and despawns what
+  // the recording did
+  vector<SlotMap::Handle> played;
+  vector<uint32_t> playedGeneration;
 
   CoreCGSystem() {
     window = make_shared<Window>();
@@ -71,11 +278,22 @@ public:
   };
 
   void loadDataFromFile(const string &desFile);
+  void restoreFromFile(const string &snapshotFile);
+  // log how far the forces with frameSystem->theta are from the exact sum
+  // and how long both take
+  void checkTheta();
+  void saveSnapshot();
+  void startRecording(const string &fileName);
+  void recordFrame();
+  void startPlayback(const string &fileName, double speed);
+  void playFrame();
 };
 
 class GLUTSystem {
 private:
   static shared_ptr<CoreCGSystem> cgSystem;
+  // object under the last click, drawn in red
+  static SlotMap::Handle picked;
 
 public:
   static void init(shared_ptr<CoreCGSystem> cgSystem);
@@ -85,8 +303,11 @@ public:
   static void drawModel(shared_ptr<Object> object, bool trans = true);
   // callback for dispaly
   static void render(void);
-  // callback for keyboard
+  // callback for keyboard, x removes the picked object and c adds a copy
+  // of it next to it
   static void keyboard(unsigned char key, int x, int y);
+  // callback for mouse, a left click picks the object under the cursor
+  static void mouse(int button, int state, int x, int y);
   // callback for reshape
   static void reshape(int w, int h);
   // callback for timer
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace ICG {
+
+// Persistent worker threads for data-parallel loops. parallelFor hands out
+// fixed-size chunks through an atomic counter, so threads that finish early
+// keep taking work and uneven chunks balance out. The calling thread works
+// too and the call returns once every chunk is done.
+class ThreadPool {
+public:
+  explicit ThreadPool(int threads = thread::hardware_concurrency()) {
+    for (int i = 1; i < max(threads, 1); ++i) {
+      workers.emplace_back([this] { run(); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      lock_guard<mutex> lock(mtx);
+      done = true;
+    }
+    wakeup.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  int size() const { return workers.size() + 1; }
+
+  void parallelFor(int n, int chunk, const function<void(int, int)> &func) {
+    if (n <= 0) {
+      return;
+    }
+    chunk = max(chunk, 1);
+    if (workers.empty() || n <= chunk) {
+      func(0, n);
+      return;
+    }
+    unique_lock<mutex> lock(mtx);
+    job = &func;
+    jobSize = n;
+    jobChunk = chunk;
+    next = 0;
+    busy = workers.size();
+    generation++;
+    lock.unlock();
+    wakeup.notify_all();
+
+    work();
+
+    lock.lock();
+    finished.wait(lock, [this] { return busy == 0; });
+    job = nullptr;
+  }
+
+private:
+  vector<thread> workers;
+  mutex mtx;
+  condition_variable wakeup, finished;
+  bool done{false};
+  long long generation{0};
+  int busy{0};
+
+  const function<void(int, int)> *job{nullptr};
+  int jobSize{0};
+  int jobChunk{1};
+  atomic<int> next{0};
+
+  void work() {
+    while (true) {
+      int begin = next.fetch_add(jobChunk);
+      if (begin >= jobSize) {
+        return;
+      }
+      (*job)(begin, min(begin + jobChunk, jobSize));
+    }
+  }
+
+  void run() {
+    long long seen = 0;
+    unique_lock<mutex> lock(mtx);
+    while (true) {
+      wakeup.wait(lock, [&] { return done || generation != seen; });
+      if (done) {
+        return;
+      }
+      seen = generation;
+      lock.unlock();
+      work();
+      lock.lock();
+      if (--busy == 0) {
+        finished.notify_one();
+      }
+    }
+  }
+};
+
+} // namespace ICG
@@ -0,0 +1,365 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <glog/logging.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace ICG {
+
+// Streaming record of per-frame object positions and orientations. Every
+// frame holds kChannels values per object: x y z in scene units and the
+// three rotation angles in degrees. Values are quantized and stored as
+// varint deltas to the previous frame, a channel that did not change costs
+// one bit, so resting and slowly moving bodies are almost free. A keyframe
+// with absolute values is written every keyInterval frames for seeking, and
+// whenever objects were spawned or despawned since the last frame. Every
+// keyframe lists the slot, generation and kind of its objects, so playback
+// can spawn and despawn the same ones.
+namespace trajectory {
+const int kChannels = 6;
+const int32_t kMagic = 0x54474349; // "ICGT"
+const int32_t kVersion = 2;
+// quantized rotations wrap around at a full turn
+const int64_t kTurn = 1 << 16;
+
+inline void putVarint(string &buffer, uint64_t value) {
+  while (value >= 0x80) {
+    buffer.push_back((char)(value | 0x80));
+    value >>= 7;
+  }
+  buffer.push_back((char)value);
+}
+
+inline bool getVarint(const string &buffer, size_t &at, uint64_t &value) {
+  value = 0;
+  for (int shift = 0; at < buffer.size() && shift < 64; shift += 7) {
+    uint8_t byte = buffer[at++];
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+inline uint64_t zigzag(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+inline int64_t unzigzag(uint64_t value) {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// an object of a frame, frames list them in slot order
+struct Body {
+  int32_t slot;
+  uint32_t generation;
+  int32_t kind;
+
+  bool operator==(const Body &other) const {
+    return slot == other.slot && generation == other.generation &&
+           kind == other.kind;
+  }
+  bool operator!=(const Body &other) const { return !(*this == other); }
+};
+
+struct Header {
+  double posStep{1e-3};
+  double rotStep{360.0 / kTurn};
+  int32_t keyInterval{256};
+};
+} // namespace trajectory
+
+class TrajectoryWriter {
+public:
+  // the step loop blocks once this many frames wait for the disk
+  size_t capacity{64};
+
+  TrajectoryWriter(const string &fileName,
+                   const trajectory::Header &header = trajectory::Header())
+      : header(header), file(fileName, ios::out | ios::binary | ios::trunc) {
+    if (not file.is_open()) {
+      LOG(ERROR) << "Cannot open trajectory file: " << fileName;
+    }
+    file.write((const char *)&trajectory::kMagic, sizeof(int32_t));
+    file.write((const char *)&trajectory::kVersion, sizeof(int32_t));
+    file.write((const char *)&this->header, sizeof(trajectory::Header));
+    worker = thread([this] { run(); });
+  }
+
+  ~TrajectoryWriter() {
+    {
+      lock_guard<mutex> lock(mtx);
+      done = true;
+    }
+    cv.notify_all();
+    worker.join();
+  }
+
+  // values holds kChannels doubles per object of bodies
+  void push(int frameCounter, vector<double> &&values,
+            vector<trajectory::Body> &&bodies) {
+    unique_lock<mutex> lock(mtx);
+    cv.wait(lock, [this] { return pending.size() < capacity; });
+    pending.push_back({frameCounter, move(values), move(bodies)});
+    lock.unlock();
+    cv.notify_all();
+  }
+
+private:
+  trajectory::Header header;
+  ofstream file;
+  mutex mtx;
+  condition_variable cv;
+  struct Pending {
+    int frameCounter;
+    vector<double> values;
+    vector<trajectory::Body> bodies;
+  };
+  deque<Pending> pending;
+  bool done{false};
+  thread worker;
+
+  // encoder state, only touched by the worker
+  vector<int64_t> last;
+  vector<trajectory::Body> lastBodies;
+  int64_t written{0};
+
+  void run() {
+    unique_lock<mutex> lock(mtx);
+    string record, payload;
+    while (true) {
+      cv.wait(lock, [this] { return done || !pending.empty(); });
+      if (pending.empty()) {
+        return;
+      }
+      auto frame = move(pending.front());
+      pending.pop_front();
+      lock.unlock();
+      cv.notify_all();
+
+      encode(frame.frameCounter, frame.values, frame.bodies, payload);
+      record.clear();
+      trajectory::putVarint(record, payload.size());
+      record.append(payload);
+      file.write(record.data(), record.size());
+      lock.lock();
+    }
+  }
+
+  void encode(int frameCounter, const vector<double> &values,
+              vector<trajectory::Body> &bodies, string &payload) {
+    using namespace trajectory;
+    vector<int64_t> cur(values.size());
+    for (size_t i = 0; i < values.size(); ++i) {
+      if (i % kChannels < 3) {
+        cur[i] = llround(values[i] / header.posStep);
+      } else {
+        cur[i] = llround(values[i] / header.rotStep) % kTurn;
+        cur[i] += cur[i] < 0 ? kTurn : 0;
+      }
+    }
+    bool key = written % header.keyInterval == 0 || bodies != lastBodies;
+    payload.clear();
+    payload.push_back(key ? 0 : 1);
+    putVarint(payload, zigzag(frameCounter));
+    putVarint(payload, cur.size() / kChannels);
+    if (key) {
+      for (const auto &body : bodies) {
+        putVarint(payload, body.slot);
+        putVarint(payload, body.generation);
+        putVarint(payload, body.kind);
+      }
+    }
+    for (size_t i = 0; i < cur.size(); i += kChannels) {
+      int64_t delta[kChannels];
+      uint8_t mask = 0;
+      for (int k = 0; k < kChannels; ++k) {
+        delta[k] = key ? cur[i + k] : cur[i + k] - last[i + k];
+        if (k >= 3 && !key) {
+          // shortest way around the circle
+          delta[k] = (delta[k] + kTurn / 2 + kTurn) % kTurn - kTurn / 2;
+        }
+        mask |= (delta[k] != 0) << k;
+      }
+      payload.push_back(mask);
+      for (int k = 0; k < kChannels; ++k) {
+        if (delta[k]) {
+          putVarint(payload, zigzag(delta[k]));
+        }
+      }
+    }
+    last.swap(cur);
+    lastBodies.swap(bodies);
+    written++;
+  }
+};
+
+class TrajectoryReader {
+public:
+  trajectory::Header header;
+
+  bool open(const string &fileName) {
+    using namespace trajectory;
+    file.open(fileName, ios::in | ios::binary);
+    if (not file.is_open()) {
+      LOG(ERROR) << "Cannot open trajectory file: " << fileName;
+      return false;
+    }
+    int32_t magic, version;
+    file.read((char *)&magic, sizeof(int32_t));
+    file.read((char *)&version, sizeof(int32_t));
+    file.read((char *)&header, sizeof(Header));
+    if (!file || magic != kMagic || version != kVersion) {
+      LOG(ERROR) << "Not a trajectory of this version: " << fileName;
+      return false;
+    }
+    // index every record so frames can be played in any order
+    string bytes;
+    while (true) {
+      int64_t offset = file.tellg();
+      uint64_t length = 0;
+      bool ok = false;
+      bytes.clear();
+      for (int i = 0; i < 10; ++i) {
+        char byte;
+        if (!file.get(byte)) {
+          break;
+        }
+        bytes.push_back(byte);
+        if (!(byte & 0x80)) {
+          size_t at = 0;
+          ok = getVarint(bytes, at, length);
+          break;
+        }
+      }
+      char type;
+      if (!ok || !file.get(type)) {
+        break;
+      }
+      if (type == 0) {
+        keyframes.emplace_back(offsets.size());
+      }
+      offsets.emplace_back(offset);
+      file.seekg(offset + bytes.size() + length);
+    }
+    file.clear();
+    return !offsets.empty() && !keyframes.empty() && keyframes[0] == 0;
+  }
+
+  int frameCount() const { return offsets.size(); }
+
+  // decode record index into kChannels values per object of bodies
+  bool read(int index, int &frameCounter, vector<double> &values,
+            vector<trajectory::Body> &bodies) {
+    using namespace trajectory;
+    if (index < 0 || index >= frameCount()) {
+      return false;
+    }
+    // restart from the closest keyframe at or before index unless decoding
+    // forward from the current frame is shorter
+    int key = *(upper_bound(keyframes.begin(), keyframes.end(), index) - 1);
+    if (index < current || key > current) {
+      current = key - 1;
+    }
+    while (current < index) {
+      if (!decode(current + 1)) {
+        current = -1;
+        return false;
+      }
+      current++;
+    }
+    frameCounter = lastCounter;
+    bodies = lastBodies;
+    values.resize(last.size());
+    for (size_t i = 0; i < last.size(); ++i) {
+      values[i] = last[i] * (i % kChannels < 3 ? header.posStep
+                                               : header.rotStep);
+    }
+    return true;
+  }
+
+private:
+  ifstream file;
+  vector<int64_t> offsets;
+  vector<int> keyframes;
+  int current{-1};
+  vector<int64_t> last;
+  vector<trajectory::Body> lastBodies;
+  int lastCounter{0};
+  string record;
+
+  bool decode(int index) {
+    using namespace trajectory;
+    int64_t end = index + 1 < frameCount() ? offsets[index + 1] : -1;
+    file.seekg(offsets[index]);
+    if (end < 0) {
+      record.assign(istreambuf_iterator<char>(file),
+                    istreambuf_iterator<char>());
+    } else {
+      record.resize(end - offsets[index]);
+      file.read(&record[0], record.size());
+    }
+    file.clear();
+    size_t at = 0;
+    uint64_t length, value, count;
+    if (!getVarint(record, at, length) || at >= record.size()) {
+      return false;
+    }
+    bool key = record[at++] == 0;
+    // every object takes one mask byte at least, which bounds count by the
+    // record before anything is allocated
+    if (!getVarint(record, at, value) || !getVarint(record, at, count) ||
+        count > record.size() - at) {
+      return false;
+    }
+    lastCounter = unzigzag(value);
+    if (key) {
+      last.assign(count * kChannels, 0);
+      lastBodies.resize(count);
+      for (auto &body : lastBodies) {
+        uint64_t slot, generation, kind;
+        if (!getVarint(record, at, slot) ||
+            !getVarint(record, at, generation) ||
+            !getVarint(record, at, kind)) {
+          return false;
+        }
+        body = {(int32_t)slot, (uint32_t)generation, (int32_t)kind};
+      }
+    } else if (last.size() != count * kChannels) {
+      return false;
+    }
+    for (size_t i = 0; i < last.size(); i += kChannels) {
+      if (at >= record.size()) {
+        return false;
+      }
+      uint8_t mask = record[at++];
+      for (int k = 0; k < kChannels; ++k) {
+        int64_t delta = 0;
+        if (mask & (1 << k)) {
+          if (!getVarint(record, at, value)) {
+            return false;
+          }
+          delta = unzigzag(value);
+        }
+        last[i + k] = key ? delta : last[i + k] + delta;
+        if (k >= 3) {
+          last[i + k] = (last[i + k] % kTurn + kTurn) % kTurn;
+        }
+      }
+    }
+    return at <= record.size();
+  }
+};
+
+} // namespace ICG
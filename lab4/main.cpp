@@ -11,6 +11,30 @@
 #include <GLUT/glut.h>
 
 DEFINE_string(des_file, "../files/group.des", "path to the des File");
+DEFINE_string(restore, "", "snapshot file to continue the scene from");
+DEFINE_int32(snapshot_every, 0, "write a snapshot every n frames, 0 disables");
+DEFINE_string(snapshot_prefix, "snapshot", "path prefix of snapshot files");
+DEFINE_string(record, "", "record the trajectory of every object to this file");
+DEFINE_string(play, "", "replay a recorded trajectory instead of simulating");
+DEFINE_double(play_speed, 1.0, "recorded frames per rendered frame");
+DEFINE_double(theta, 0.5, "Barnes-Hut opening angle, 0 sums forces exactly");
+DEFINE_int32(threads, 0,
+             "threads stepping the flock and baking fields, 0 uses every core");
+DEFINE_double(skin, 1.0,
+              "extra reach of the flock neighbor lists, rebuilt once an "
+              "object moves half of it");
+DEFINE_int32(sort_every, 120,
+             "re-sort objects in Morton order every n frames, 0 keeps the "
+             "des order");
+DEFINE_double(lod_near, 0,
+              "agents farther than this from the viewer and from food "
+              "update their forces every 2nd, 4th or 8th frame, 0 updates "
+              "all every frame");
+DEFINE_int32(lod_budget, 0,
+             "agents updated per frame on average, the lod tiers shrink "
+             "to fit, 0 is unbounded");
+DEFINE_bool(check_theta, false,
+            "log the force error and time of theta against the exact sum");
 
 using namespace ICG;
 
@@ -30,8 +54,29 @@ int main(int argc, char *argv[]) {
                          cgSystem->window->yPosition);
   glutCreateWindow(argv[0]);
 
+  // the field lines of the des file bake on these threads
+  cgSystem->frameSystem->threads = FLAGS_threads;
   // load Files
   cgSystem->loadDataFromFile(FLAGS_des_file);
+  if (!FLAGS_restore.empty()) {
+    cgSystem->restoreFromFile(FLAGS_restore);
+  }
+  cgSystem->frameSystem->theta = FLAGS_theta;
+  cgSystem->frameSystem->nearby.skin = FLAGS_skin;
+  cgSystem->frameSystem->sortEvery = FLAGS_sort_every;
+  cgSystem->frameSystem->lod.near = FLAGS_lod_near;
+  cgSystem->frameSystem->lod.budget = FLAGS_lod_budget;
+  if (FLAGS_check_theta) {
+    cgSystem->checkTheta();
+  }
+  cgSystem->snapshotEvery = FLAGS_snapshot_every;
+  cgSystem->snapshotPrefix = FLAGS_snapshot_prefix;
+  if (!FLAGS_record.empty()) {
+    cgSystem->startRecording(FLAGS_record);
+  }
+  if (!FLAGS_play.empty()) {
+    cgSystem->startPlayback(FLAGS_play, FLAGS_play_speed);
+  }
   // init GLUTSystem
   GLUTSystem::init(cgSystem);
 
@@ -39,6 +84,7 @@ int main(int argc, char *argv[]) {
   glutDisplayFunc(GLUTSystem::render);
   glutReshapeFunc(GLUTSystem::reshape);
   glutKeyboardFunc(GLUTSystem::keyboard);
+  glutMouseFunc(GLUTSystem::mouse);
   glutTimerFunc(1000.0 / cgSystem->frameSystem->fps, GLUTSystem::timer, 0);
   // main loop
   glutMainLoop();